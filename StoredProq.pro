@@ -21,6 +21,20 @@ HEADERS += \
     src/operation.h \
     src/sqlmapper.h \
     src/queryresult.h \
-    src/pg_types.h
+    src/pg_types.h \
+    src/sqlerror.h \
+    src/sqlcancel.h \
+    src/pqsession.h \
+    src/sqlcatalog.h \
+    src/sqlrouter.h \
+    src/sqltracer.h \
+    src/pqtypes.h \
+    src/pqresult.h \
+    src/pqcatalog.h \
+    src/pqmapper.h \
+    src/pqmapper_qt.h
 
-CONFIG += c++11
+INCLUDEPATH += $$system(pg_config --includedir)
+LIBS += -lpq
+
+CONFIG += c++17
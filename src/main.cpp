@@ -32,6 +32,7 @@
 #include <QSqlQuery>
 #include <QSqlRecord>
 #include "sqlmapper.h"
+#include "pqmapper_qt.h"
 
 int main(int, char *[])
 {
@@ -108,6 +109,33 @@ int main(int, char *[])
     SqlBindingMapper<QJsonDocument, QJsonDocument, QString> json_extractor("test_json");
     qDebug() << json_extractor(doc, "{hello}").toJson();
 
+    SqlBindingMapper<void, int> sleeper("pg_sleep");
+    try {
+        sleeper.callWithTimeout(100, 1);
+    } catch (const SqlTimeoutError &e) {
+        qDebug() << "Timed out :" << e.what();
+    }
+
+    SqlCallTracer tracer("/tmp/storedproq.trace");
+    tracer.setThreshold(50);
+    sleeper.setTracer(&tracer);
+    sleeper(1);
+    qDebug() << "Slow call traced in /tmp/storedproq.trace";
+
+    PqConnection connection("host=localhost dbname=test user=moi password=moi");
+    PqBindingMapper<PqRows<int>, int, int> pqGenerateSeries(connection, "generate_series");
+    pqGenerateSeries.setTimeout(std::chrono::milliseconds(200));
+    for (int i: pqGenerateSeries(1, 10))
+        qDebug() << i;
+
+    PqBindingMapper<std::vector<int>, int, int, int, int, int> pqBuildArray(connection, "build_array");
+    for (int i: pqBuildArray(1, 2123, 1233, 1, 15))
+        qDebug() << "Got i from array with libpq :" << i;
+
+    PqBindingMapper<QList<Operation*>> pqListAll(connection, "list_all");
+    for (Operation *op: pqListAll())
+        qDebug() << op->id() << op->bookingDate();
+
 #if 0
 
     SqlBindingMapper<int, std::tuple<int, int>> summer("sum_me");
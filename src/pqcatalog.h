@@ -0,0 +1,117 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PQCATALOG_H
+#define PQCATALOG_H
+
+#include <libpq-fe.h>
+
+#include <string>
+#include <vector>
+
+#include "pqtypes.h"
+#include "pqresult.h"
+
+// Volatility of a function, as stored in pg_proc.provolatile
+enum class SqlVolatility
+{
+    Unknown,
+    Immutable,
+    Stable,
+    Volatile
+};
+
+inline SqlVolatility _volatilityFromCatalog(const std::string &provolatile)
+{
+    if (provolatile == "i")
+        return SqlVolatility::Immutable;
+    if (provolatile == "s")
+        return SqlVolatility::Stable;
+    return SqlVolatility::Volatile;
+}
+
+struct PqFunctionInfo
+{
+    PqFunctionInfo() : volatility(SqlVolatility::Unknown) {}
+
+    SqlVolatility volatility;
+    // Names of the columns returned by the function, empty when unknown or not a composite result
+    std::vector<std::string> outputColumns;
+};
+
+/*
+ * Look up a function in pg_catalog.
+ * Without schema, only the functions visible in the search_path are considered.
+ * When several overloads take argCount arguments, the most volatile one wins.
+ * A failure would abort the transaction of the caller, so nothing is done and
+ * false is returned unless the connection is idle.
+ */
+inline bool _pqLookupFunction(PGconn *connection, const std::string &schemaName, const std::string &functionName,
+                              int argCount, PqFunctionInfo &info)
+{
+    if (!connection || PQtransactionStatus(connection) != PQTRANS_IDLE)
+        return false;
+
+    const std::string argCountText = std::to_string(argCount);
+    const char *values[] = { functionName.c_str(), argCountText.c_str(), schemaName.c_str() };
+    // Output columns come from the attributes of the composite return type, or from the OUT/INOUT/TABLE arguments
+    PqResult result(PQexecParams(connection,
+                                 "SELECT p.provolatile, COALESCE("
+                                 "(SELECT array_agg(a.attname ORDER BY a.attnum) FROM pg_catalog.pg_type t "
+                                 "JOIN pg_catalog.pg_attribute a ON a.attrelid = t.typrelid "
+                                 "WHERE t.oid = p.prorettype AND a.attnum > 0 AND NOT a.attisdropped), "
+                                 "(SELECT array_agg(COALESCE(x.name, '') ORDER BY x.ord) FROM unnest(p.proargnames, p.proargmodes) "
+                                 "WITH ORDINALITY AS x(name, mode, ord) WHERE x.mode IN ('o', 'b', 't')))::text "
+                                 "FROM pg_catalog.pg_proc p "
+                                 "JOIN pg_catalog.pg_namespace n ON n.oid = p.pronamespace "
+                                 "WHERE p.proname = $1 AND p.pronargs = $2::integer "
+                                 "AND (n.nspname = $3 OR ($3 = '' AND pg_catalog.pg_function_is_visible(p.oid)));",
+                                 3, nullptr, values, nullptr, nullptr, 0));
+    if (PQresultStatus(result.get()) != PGRES_TUPLES_OK)
+        _pqThrow(connection, result.get());
+
+    info = PqFunctionInfo();
+    for (int row = 0 ; row < PQntuples(result.get()) ; row++) {
+        SqlVolatility volatility = _volatilityFromCatalog(_pqDecode<std::string>(result.get(), row, 0));
+        if (volatility > info.volatility)
+            info.volatility = volatility;
+        std::vector<std::string> outputColumns = _pqDecode<std::vector<std::string>>(result.get(), row, 1);
+        // Unnamed OUT arguments can not be selected by name
+        for (const std::string &column: outputColumns) {
+            if (column.empty()) {
+                outputColumns.clear();
+                break;
+            }
+        }
+        // Overloads returning different columns can not be told apart here
+        if (row == 0)
+            info.outputColumns = outputColumns;
+        else if (info.outputColumns != outputColumns)
+            info.outputColumns.clear();
+    }
+    return true;
+}
+
+#endif // PQCATALOG_H
@@ -0,0 +1,316 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PQMAPPER_H
+#define PQMAPPER_H
+
+#include <libpq-fe.h>
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "pqtypes.h"
+#include "pqresult.h"
+#include "pqcatalog.h"
+#include "pqsession.h"
+#include "sqlerror.h"
+#include "sqlcancel.h"
+
+/*
+ * Stored procedures mapping over libpq, using only standard types.
+ * Qt types can be added with pqmapper_qt.h.
+ * Timeouts, cancellation, errors and column projection work as with
+ * SqlBindingMapper and share its code. Replica routing and call tracing are
+ * built on QSqlDatabase connections and remain specific to SqlBindingMapper.
+ */
+
+inline std::string _pqQuoteIdentifier(const std::string &identifier)
+{
+    std::string result = "\"";
+    for (char c: identifier) {
+        if (c == '"')
+            result += '"';
+        result += c;
+    }
+    result += '"';
+    return result;
+}
+
+// One libpq connection, used from one thread at a time
+class PqConnection
+{
+public:
+    explicit PqConnection(const std::string &connectionInfo)
+        : m_connection(PQconnectdb(connectionInfo.c_str())),
+          m_statementCount(0)
+    {
+        if (PQstatus(m_connection) != CONNECTION_OK) {
+            std::string message = PQerrorMessage(m_connection);
+            PQfinish(m_connection);
+            throw SqlConnectionError(message);
+        }
+
+        // The text format decoding in pqtypes.h depends on these settings
+        PqResult result(PQsetClientEncoding(m_connection, "UTF8") == 0
+                        ? PQexec(m_connection, "SET DateStyle TO ISO; SET extra_float_digits TO 3;")
+                        : nullptr);
+        if (PQresultStatus(result.get()) != PGRES_COMMAND_OK) {
+            std::string message = result ? PQresultErrorMessage(result.get()) : PQerrorMessage(m_connection);
+            PQfinish(m_connection);
+            throw SqlConnectionError(message);
+        }
+    }
+
+    ~PqConnection() { PQfinish(m_connection); }
+
+    PqConnection(const PqConnection &) = delete;
+    PqConnection &operator=(const PqConnection &) = delete;
+
+    PGconn *handle() const { return m_connection; }
+
+    // Name for a new prepared statement on this connection
+    std::string nextStatementName() {
+        _deallocateReleased();
+        return "storedproq_" + std::to_string(++m_statementCount);
+    }
+
+    // The prepared statement is not used anymore. It is deallocated at once, or after the
+    // current transaction when it failed, since no command runs in an aborted transaction.
+    void releaseStatement(const std::string &statementName) {
+        m_releasedStatements.push_back(statementName);
+        _deallocateReleased();
+    }
+
+private:
+    void _deallocateReleased() {
+        const PGTransactionStatusType status = PQtransactionStatus(m_connection);
+        if (status != PQTRANS_IDLE && status != PQTRANS_INTRANS)
+            return;
+        while (!m_releasedStatements.empty()) {
+            std::string query = "DEALLOCATE " + _pqQuoteIdentifier(m_releasedStatements.back()) + ";";
+            PqResult result(PQexec(m_connection, query.c_str()));
+            m_releasedStatements.pop_back();
+        }
+    }
+
+    PGconn *m_connection;
+    unsigned int m_statementCount;
+    std::vector<std::string> m_releasedStatements;
+};
+
+// Placeholders: a cast to the parameter type when known, composite types for tuples
+template <typename T>
+struct pq_placeholder
+{
+    static std::string build(int &index) {
+        std::string result = "$" + std::to_string(++index);
+        if (pq_type<T>::known)
+            result += std::string("::") + pq_type<T>::name();
+        return result;
+    }
+};
+
+template <typename ...Args>
+struct pq_placeholder<std::tuple<Args...>>
+{
+    static std::string build(int &index) {
+        std::string result = "ROW(";
+        bool first = true;
+        ((result += (first ? "" : ", ") + pq_placeholder<Args>::build(index), first = false), ...);
+        return result + ")";
+    }
+};
+
+template <typename T>
+inline void _pqBind(std::vector<std::optional<std::string>> &values, const T &value)
+{
+    values.push_back(pq_type<T>::encode(value));
+}
+
+template <typename ...Args>
+inline void _pqBind(std::vector<std::optional<std::string>> &values, const std::tuple<Args...> &value)
+{
+    std::apply([&values](const Args &... items) { (_pqBind(values, items), ...); }, value);
+}
+
+template <typename... Args>
+inline std::string _pqBuildQuery(const std::string &functionName, const std::vector<std::string> &columns)
+{
+    std::string selectList;
+    for (const std::string &column: columns)
+        selectList += (selectList.empty() ? "" : ", ") + _pqQuoteIdentifier(column);
+    if (selectList.empty())
+        selectList = "*";
+
+    [[maybe_unused]] int index = 0;
+    std::string placeHolders;
+    ((placeHolders += (placeHolders.empty() ? "" : ", ") + pq_placeholder<Args>::build(index)), ...);
+    return "SELECT " + selectList + " FROM " + functionName + "(" + placeHolders + ");";
+}
+
+template <typename T, typename... Arguments>
+class PqBindingMapper
+{
+public:
+    PqBindingMapper(PqConnection &connection, const std::string &functionName)
+        : PqBindingMapper(connection, std::string(), functionName) {}
+
+    PqBindingMapper(PqConnection &connection, const std::string &schemaName, const std::string &functionName)
+        : m_connection(connection),
+          m_schemaName(schemaName),
+          m_functionName(functionName),
+          m_functionInfoLoaded(false),
+          m_timeout(0)
+    {}
+
+    // The connection must outlive its mappers
+    ~PqBindingMapper() {
+        _release();
+    }
+
+    PqBindingMapper(const PqBindingMapper &) = delete;
+    PqBindingMapper &operator=(const PqBindingMapper &) = delete;
+
+    T operator() (Arguments... params) {
+        return callWithTimeout(m_timeout, params...);
+    }
+
+    // Same as operator(), with a deadline overriding the mapper one for this call only
+    T callWithTimeout (std::chrono::milliseconds timeout, Arguments... params) {
+        PGconn *connection = m_connection.handle();
+        // A statement prepared while the catalog could not be read is replaced once it can
+        if (!m_statementName.empty() && !m_functionInfoLoaded && _needsCatalog()
+                && PQtransactionStatus(connection) == PQTRANS_IDLE)
+            _release();
+        if (m_statementName.empty())
+            _prepare();
+
+        std::vector<std::optional<std::string>> values;
+        values.reserve(sizeof...(Arguments));
+        (_pqBind(values, params), ...);
+        std::vector<const char *> rawValues;
+        rawValues.reserve(values.size());
+        for (const std::optional<std::string> &value: values)
+            rawValues.push_back(value ? value->c_str() : nullptr);
+
+        PqStatementTimeout statementTimeout(connection, int(timeout.count()));
+
+        PqResult result;
+        {
+            SqlCancelGuard guard(connection, timeout);
+            {
+                SqlRunningCall::Scope running(m_runningCall, guard);
+                result.reset(PQexecPrepared(connection, m_statementName.c_str(), int(rawValues.size()),
+                                            rawValues.data(), nullptr, nullptr, 0));
+            }
+            ExecStatusType status = PQresultStatus(result.get());
+            if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK)
+                _pqThrow(connection, result.get(), &guard, timeout.count() > 0);
+        }
+
+        return m_mapper.map(result.get());
+    }
+
+    // Deadline applied to every call, 0 (the default) means no deadline.
+    // It is enforced both by the server statement_timeout and by a client side cancel request.
+    void setTimeout(std::chrono::milliseconds timeout) { m_timeout = timeout; }
+    std::chrono::milliseconds timeout() const { return m_timeout; }
+
+    // Declare the columns to select instead of deriving them from the row type and the catalog.
+    // Tuples are mapped by position, so the names must be given in the tuple order.
+    void setResultColumns(const std::vector<std::string> &columns) {
+        m_resultColumns = columns;
+        _release();
+    }
+    const std::vector<std::string> &resultColumns() const { return m_resultColumns; }
+
+    // Cancel the call currently running, if any. May be called from any thread.
+    void cancel() {
+        m_runningCall.cancel();
+    }
+
+    std::string sqlFunctionName() const {
+        if (!m_schemaName.empty())
+            return _pqQuoteIdentifier(m_schemaName) + "." + _pqQuoteIdentifier(m_functionName);
+        else
+            return _pqQuoteIdentifier(m_functionName);
+    }
+
+private:
+    void _release() {
+        if (m_statementName.empty())
+            return;
+        m_connection.releaseStatement(m_statementName);
+        m_statementName.clear();
+    }
+
+    bool _needsCatalog() const {
+        return m_resultColumns.empty() && PqResultMapper<T>::row_type::needsCatalog;
+    }
+
+    void _prepare() {
+        std::vector<std::string> columns = m_resultColumns;
+        if (columns.empty()) {
+            if (_needsCatalog() && !m_functionInfoLoaded) {
+                // The lookup is only an optimization, a failure falls back to SELECT *.
+                // After a connection error it is done again once the statement is replaced.
+                try {
+                    m_functionInfoLoaded = _pqLookupFunction(m_connection.handle(), m_schemaName, m_functionName,
+                                                             sizeof...(Arguments), m_functionInfo);
+                } catch (const SqlConnectionError &) {
+                    m_functionInfo = PqFunctionInfo();
+                } catch (const SqlError &) {
+                    m_functionInfo = PqFunctionInfo();
+                    m_functionInfoLoaded = true;
+                }
+            }
+            columns = PqResultMapper<T>::row_type::columns(m_functionInfo.outputColumns);
+        }
+
+        std::string statementName = m_connection.nextStatementName();
+        std::string query = _pqBuildQuery<Arguments...>(sqlFunctionName(), columns);
+        PqResult result(PQprepare(m_connection.handle(), statementName.c_str(), query.c_str(), 0, nullptr));
+        if (PQresultStatus(result.get()) != PGRES_COMMAND_OK)
+            _pqThrow(m_connection.handle(), result.get());
+        m_statementName = statementName;
+    }
+
+    PqConnection &m_connection;
+    std::string m_schemaName;
+    std::string m_functionName;
+    PqResultMapper<T> m_mapper;
+    std::string m_statementName;
+    std::vector<std::string> m_resultColumns;
+    PqFunctionInfo m_functionInfo;
+    bool m_functionInfoLoaded;
+    std::chrono::milliseconds m_timeout;
+    SqlRunningCall m_runningCall;
+};
+
+#endif // PQMAPPER_H
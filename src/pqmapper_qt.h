@@ -0,0 +1,198 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PQMAPPER_QT_H
+#define PQMAPPER_QT_H
+
+#include <QByteArray>
+#include <QDate>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QList>
+#include <QMetaProperty>
+#include <QObject>
+#include <QString>
+#include <QVariant>
+
+#include <algorithm>
+
+#include "pqmapper.h"
+
+/*
+ * Qt types for PqBindingMapper: QString, QDate, QDateTime, QJsonDocument,
+ * QObject rows and QList results.
+ */
+
+// Null QStrings are sent as NULL, text is converted from and to UTF-8 directly
+template <>
+struct pq_type<QString>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "text"; }
+    static std::optional<std::string> encode(const QString &value) {
+        if (value.isNull())
+            return std::nullopt;
+        QByteArray utf8 = value.toUtf8();
+        return std::string(utf8.constData(), utf8.size());
+    }
+    static QString decode(const char *value, int length) { return QString::fromUtf8(value, length); }
+};
+
+template <>
+struct pq_type<QDate>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "date"; }
+    static std::optional<std::string> encode(const QDate &value) {
+        if (!value.isValid())
+            return std::nullopt;
+        return value.toString(Qt::ISODate).toStdString();
+    }
+    static QDate decode(const char *value, int length) {
+        QDate result = QDate::fromString(QString::fromLatin1(value, length), Qt::ISODate);
+        if (!result.isValid())
+            _pqInvalidValue(name(), value, length);
+        return result;
+    }
+};
+
+// timestamp with time zone, infinite values can not be represented and throw SqlError
+template <>
+struct pq_type<QDateTime>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "timestamp with time zone"; }
+    static std::optional<std::string> encode(const QDateTime &value) {
+        if (!value.isValid())
+            return std::nullopt;
+        const qint64 msecs = value.toMSecsSinceEpoch();
+        if (msecs > LLONG_MAX / 1000 || msecs < LLONG_MIN / 1000)
+            throw SqlError("QDateTime out of the range of PostgreSQL: " + value.toString(Qt::ISODate).toStdString());
+        return _pqEncodeTimestamp(msecs * 1000);
+    }
+    static QDateTime decode(const char *value, int length) {
+        const std::string text(value, length);
+        if (text == "infinity" || text == "-infinity")
+            throw SqlError("Infinite timestamps can not be represented by QDateTime: " + text);
+        const long long micros = _pqDecodeTimestamp(name(), value, length);
+        // Rounded down, so that times before 1970 keep their millisecond
+        return QDateTime::fromMSecsSinceEpoch(micros >= 0 ? micros / 1000 : -((-micros + 999) / 1000));
+    }
+};
+
+template <>
+struct pq_type<QJsonDocument>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "json"; }
+    static std::optional<std::string> encode(const QJsonDocument &value) {
+        if (value.isNull())
+            return std::nullopt;
+        QByteArray json = value.toJson(QJsonDocument::Compact);
+        return std::string(json.constData(), json.size());
+    }
+    static QJsonDocument decode(const char *value, int length) {
+        return QJsonDocument::fromJson(QByteArray(value, length));
+    }
+};
+
+// Decode a field for a property of the given type, other types are converted from the text by QVariant
+inline QVariant _pqDecodeVariant(int type, const char *value, int length)
+{
+    switch (type) {
+    case QMetaType::Bool:
+        return pq_type<bool>::decode(value, length);
+    case QMetaType::Int:
+        return pq_type<int>::decode(value, length);
+    case QMetaType::LongLong:
+        return qlonglong(pq_type<long long>::decode(value, length));
+    case QMetaType::Double:
+        return pq_type<double>::decode(value, length);
+    case QMetaType::QDate:
+        return pq_type<QDate>::decode(value, length);
+    case QMetaType::QDateTime:
+        return pq_type<QDateTime>::decode(value, length);
+    case QMetaType::QJsonDocument:
+        return QVariant::fromValue(pq_type<QJsonDocument>::decode(value, length));
+    default:
+        return pq_type<QString>::decode(value, length);
+    }
+}
+
+// QObject rows: each column is written to the property of the same name
+template <typename T>
+struct pq_row<T, typename std::enable_if<std::is_base_of<QObject, typename std::remove_pointer<T>::type>::value>::type>
+{
+    typedef typename std::remove_pointer<T>::type R;
+
+    // The properties declared by the class and returned by the function, like SqlResultColumns
+    static constexpr bool needsCatalog = true;
+    static std::vector<std::string> columns(const std::vector<std::string> &outputColumns) {
+        std::vector<std::string> result;
+        const QMetaObject &metaObject = R::staticMetaObject;
+        for (int i = QObject::staticMetaObject.propertyCount() ; i < metaObject.propertyCount() ; i++)
+        {
+            std::string name = metaObject.property(i).name();
+            if (std::find(outputColumns.begin(), outputColumns.end(), name) != outputColumns.end())
+                result.push_back(name);
+        }
+        return result;
+    }
+
+    static R *map(const PGresult *result, int row) {
+        R *target = new R();
+        const QMetaObject *metaObject = target->metaObject();
+        for (int column = 0 ; column < PQnfields(result) ; column++)
+        {
+            int propIdx = metaObject->indexOfProperty(PQfname(result, column));
+            if (propIdx < 0)
+                continue;
+            QMetaProperty prop = metaObject->property(propIdx);
+            // An invalid QVariant resets the property, or sets its default value
+            QVariant value;
+            if (!PQgetisnull(result, row, column))
+                value = _pqDecodeVariant(prop.userType(), PQgetvalue(result, row, column), PQgetlength(result, row, column));
+            prop.write(target, value);
+        }
+        return target;
+    }
+};
+
+template <typename T>
+struct PqResultMapper<QList<T>>
+{
+    typedef pq_row<T> row_type;
+
+    QList<T> map(const PGresult *result) {
+        QList<T> rows;
+        const int count = PQntuples(result);
+        rows.reserve(count);
+        for (int row = 0 ; row < count ; row++)
+            rows << row_type::map(result, row);
+        return rows;
+    }
+};
+
+#endif // PQMAPPER_QT_H
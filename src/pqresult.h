@@ -0,0 +1,209 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PQRESULT_H
+#define PQRESULT_H
+
+#include <libpq-fe.h>
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "pqtypes.h"
+#include "sqlerror.h"
+#include "sqlcancel.h"
+
+struct _PqResultDeleter
+{
+    void operator()(PGresult *result) const { PQclear(result); }
+};
+
+typedef std::unique_ptr<PGresult, _PqResultDeleter> PqResult;
+
+[[noreturn]] inline void _pqThrow(PGconn *connection, const PGresult *result,
+                                  const SqlCancelGuard *guard = nullptr, bool hasDeadline = false)
+{
+    std::string message = result ? PQresultErrorMessage(result) : PQerrorMessage(connection);
+    const char *sqlState = result ? PQresultErrorField(result, PG_DIAG_SQLSTATE) : nullptr;
+    _throwSqlError(message, sqlState ? sqlState : "",
+                   guard && guard->cancelled(), guard && guard->deadlineExpired(), hasDeadline,
+                   PQstatus(connection) == CONNECTION_BAD);
+}
+
+template <typename T>
+inline T _pqDecode(const PGresult *result, int row, int column)
+{
+    if (PQgetisnull(result, row, column))
+        return _pqNull<T>(0);
+    return pq_type<T>::decode(PQgetvalue(result, row, column), PQgetlength(result, row, column));
+}
+
+/*
+ * Describes a plain struct as a list of named fields, so that it can be used as a row.
+ * Specialize pq_struct for the struct:
+ *
+ *   template <>
+ *   struct pq_struct<Account>
+ *   {
+ *       static constexpr bool known = true;
+ *       static auto fields() { return std::make_tuple(pq_field("id", &Account::id), pq_field("name", &Account::name)); }
+ *   };
+ */
+template <typename S, typename F>
+struct pq_field_descriptor
+{
+    typedef F type;
+
+    const char *name;
+    F S::*member;
+};
+
+template <typename S, typename F>
+constexpr pq_field_descriptor<S, F> pq_field(const char *name, F S::*member)
+{
+    return pq_field_descriptor<S, F>{name, member};
+}
+
+template <typename T>
+struct pq_struct
+{
+    static constexpr bool known = false;
+};
+
+/*
+ * Maps one row of a result.
+ * columns() lists the columns read, in the order they are expected, or is
+ * empty when the row reads the whole function result (SELECT *).
+ * outputColumns are the columns returned by the function, as found in the
+ * catalog when needsCatalog is set (empty if unknown).
+ */
+template <typename T, typename Enable = void>
+struct pq_row
+{
+    static constexpr bool needsCatalog = false;
+    static std::vector<std::string> columns(const std::vector<std::string> &) { return std::vector<std::string>(); }
+    static T map(const PGresult *result, int row) { return _pqDecode<T>(result, row, 0); }
+};
+
+// Tuples are mapped by position: the first columns returned by the function
+template <typename ...Args>
+struct pq_row<std::tuple<Args...>>
+{
+    static constexpr bool needsCatalog = true;
+    static std::vector<std::string> columns(const std::vector<std::string> &outputColumns) {
+        if (outputColumns.size() <= sizeof...(Args))
+            return std::vector<std::string>();
+        return std::vector<std::string>(outputColumns.begin(), outputColumns.begin() + sizeof...(Args));
+    }
+    static std::tuple<Args...> map(const PGresult *result, int row) {
+        return _map(result, row, std::index_sequence_for<Args...>());
+    }
+
+private:
+    template <std::size_t... Idx>
+    static std::tuple<Args...> _map(const PGresult *result, int row, std::index_sequence<Idx...>) {
+        return std::tuple<Args...>(_pqDecode<Args>(result, row, int(Idx))...);
+    }
+};
+
+// Structs are selected by field name and mapped in the declaration order
+template <typename T>
+struct pq_row<T, typename std::enable_if<pq_struct<T>::known>::type>
+{
+    static constexpr bool needsCatalog = false;
+    static std::vector<std::string> columns(const std::vector<std::string> &) {
+        std::vector<std::string> result;
+        std::apply([&result](auto... field) { (result.push_back(field.name), ...); }, pq_struct<T>::fields());
+        return result;
+    }
+
+    static T map(const PGresult *result, int row) {
+        T value;
+        int column = 0;
+        std::apply([&](auto... field) {
+            ((value.*(field.member) = _pqDecode<typename decltype(field)::type>(result, row, column++)), ...);
+        }, pq_struct<T>::fields());
+        return value;
+    }
+};
+
+template <>
+struct pq_row<void>
+{
+    static constexpr bool needsCatalog = false;
+    static std::vector<std::string> columns(const std::vector<std::string> &) { return std::vector<std::string>(); }
+};
+
+template <typename T>
+struct PqResultMapper
+{
+    typedef pq_row<T> row_type;
+
+    // The first row, or the null value when the function returned none
+    T map(const PGresult *result) {
+        if (PQntuples(result) == 0)
+            return _pqNull<T>(0);
+        return row_type::map(result, 0);
+    }
+};
+
+/*
+ * Every row of a result. As in SqlBindingMapper, a std::vector result is one
+ * array value, so the rows have their own container (QList with pqmapper_qt.h).
+ */
+template <typename T>
+class PqRows : public std::vector<T>
+{
+public:
+    using std::vector<T>::vector;
+};
+
+template <typename T>
+struct PqResultMapper<PqRows<T>>
+{
+    typedef pq_row<T> row_type;
+
+    PqRows<T> map(const PGresult *result) {
+        PqRows<T> rows;
+        const int count = PQntuples(result);
+        rows.reserve(count);
+        for (int row = 0 ; row < count ; row++)
+            rows.push_back(row_type::map(result, row));
+        return rows;
+    }
+};
+
+template <>
+struct PqResultMapper<void>
+{
+    typedef pq_row<void> row_type;
+
+    void map(const PGresult *) {}
+};
+
+#endif // PQRESULT_H
@@ -0,0 +1,147 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PQSESSION_H
+#define PQSESSION_H
+
+#include <libpq-fe.h>
+#include <libpq-events.h>
+
+#include <string>
+
+#include "pqresult.h"
+
+/*
+ * Session settings changed by the mappers, attached to each libpq connection
+ * as event instance data so that they are forgotten with the connection.
+ */
+struct _PqSessionState
+{
+    _PqSessionState() : statementTimeout(0) {}
+
+    // Session (not transaction local) statement_timeout set by the mappers, 0 for the server default
+    int statementTimeout;
+};
+
+inline int _pqSessionEvents(PGEventId id, void *eventInfo, void *)
+{
+    switch (id) {
+    case PGEVT_REGISTER: {
+        PGconn *connection = static_cast<PGEventRegister *>(eventInfo)->conn;
+        return PQsetInstanceData(connection, _pqSessionEvents, new _PqSessionState());
+    }
+    case PGEVT_CONNRESET: {
+        PGconn *connection = static_cast<PGEventConnReset *>(eventInfo)->conn;
+        _PqSessionState *state = static_cast<_PqSessionState *>(PQinstanceData(connection, _pqSessionEvents));
+        if (state)
+            *state = _PqSessionState();
+        break;
+    }
+    case PGEVT_CONNDESTROY: {
+        PGconn *connection = static_cast<PGEventConnDestroy *>(eventInfo)->conn;
+        delete static_cast<_PqSessionState *>(PQinstanceData(connection, _pqSessionEvents));
+        break;
+    }
+    default:
+        break;
+    }
+    return 1;
+}
+
+// State of the connection, nullptr if it could not be attached
+inline _PqSessionState *_pqSessionState(PGconn *connection)
+{
+    _PqSessionState *state = static_cast<_PqSessionState *>(PQinstanceData(connection, _pqSessionEvents));
+    if (!state && PQregisterEventProc(connection, _pqSessionEvents, "storedproq", nullptr))
+        state = static_cast<_PqSessionState *>(PQinstanceData(connection, _pqSessionEvents));
+    return state;
+}
+
+/*
+ * Makes statement_timeout match msecs (0 for the server default) for one call.
+ * Outside of a transaction the session value is set, and skipped when it is already right.
+ * Inside a transaction SET LOCAL is used, so that a rollback can not leave the session
+ * different from what was recorded, and the session value is put back when the guard
+ * is destroyed so that the following statements of the transaction do not inherit the
+ * deadline. This costs two more round trips, only for the calls whose deadline differs
+ * from the session value. A failed call aborts the transaction, whose rollback drops
+ * the local value. Values set by the application itself are not tracked.
+ */
+class PqStatementTimeout
+{
+public:
+    PqStatementTimeout(PGconn *connection, int msecs)
+        : m_connection(nullptr)
+    {
+        if (!connection)
+            return;
+        _PqSessionState *state = _pqSessionState(connection);
+        const PGTransactionStatusType status = PQtransactionStatus(connection);
+        const int timeout = msecs > 0 ? msecs : 0;
+        if (state && state->statementTimeout == timeout)
+            return;
+
+        std::string query;
+        if (status == PQTRANS_IDLE) {
+            query = "SET statement_timeout TO " + _value(timeout) + ";";
+        } else if (status == PQTRANS_INTRANS) {
+            query = "SET LOCAL statement_timeout TO " + _value(timeout) + ";";
+        } else {
+            // Aborted transaction or broken connection, the call itself will report it
+            return;
+        }
+
+        PqResult result(PQexec(connection, query.c_str()));
+        if (PQresultStatus(result.get()) != PGRES_COMMAND_OK)
+            _pqThrow(connection, result.get());
+
+        if (status == PQTRANS_IDLE) {
+            if (state)
+                state->statementTimeout = timeout;
+        } else {
+            m_connection = connection;
+            m_restore = "SET LOCAL statement_timeout TO " + _value(state ? state->statementTimeout : 0) + ";";
+        }
+    }
+
+    ~PqStatementTimeout() {
+        // Nothing to restore once the transaction failed, and an error here leaves the call result untouched
+        if (m_connection && PQtransactionStatus(m_connection) == PQTRANS_INTRANS)
+            PQclear(PQexec(m_connection, m_restore.c_str()));
+    }
+
+    PqStatementTimeout(const PqStatementTimeout &) = delete;
+    PqStatementTimeout &operator=(const PqStatementTimeout &) = delete;
+
+private:
+    static std::string _value(int msecs) {
+        return msecs > 0 ? std::to_string(msecs) : std::string("DEFAULT");
+    }
+
+    PGconn *m_connection;
+    std::string m_restore;
+};
+
+#endif // PQSESSION_H
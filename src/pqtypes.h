@@ -0,0 +1,364 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PQTYPES_H
+#define PQTYPES_H
+
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "sqlerror.h"
+
+/*
+ * Conversions between C++ types and the PostgreSQL text format, without Qt.
+ * name() is the SQL type used to cast the parameters, encode() returns the text
+ * sent for a value (std::nullopt for NULL) and decode() reads a non-NULL field,
+ * throwing SqlError when it can not be parsed. Decoding expects the session
+ * settings pinned by PqConnection (DateStyle ISO, UTF8, extra_float_digits 3).
+ */
+[[noreturn]] inline void _pqInvalidValue(const char *type, const char *value, int length)
+{
+    throw SqlError("Invalid " + std::string(type) + " value received: " + std::string(value, length));
+}
+
+inline long long _pqDecodeInteger(const char *type, const char *value, int length, long long minimum, long long maximum)
+{
+    long long result;
+    std::from_chars_result parsed = std::from_chars(value, value + length, result);
+    if (parsed.ec != std::errc() || parsed.ptr != value + length || result < minimum || result > maximum)
+        _pqInvalidValue(type, value, length);
+    return result;
+}
+
+template <typename T, typename Enable = void>
+struct pq_type
+{
+    static constexpr bool known = false;
+    static constexpr const char *name() { return ""; }
+};
+
+template <>
+struct pq_type<int>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "integer"; }
+    static std::optional<std::string> encode(int value) { return std::to_string(value); }
+    static int decode(const char *value, int length) { return int(_pqDecodeInteger(name(), value, length, INT_MIN, INT_MAX)); }
+};
+
+template <>
+struct pq_type<long long>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "bigint"; }
+    static std::optional<std::string> encode(long long value) { return std::to_string(value); }
+    static long long decode(const char *value, int length) { return _pqDecodeInteger(name(), value, length, LLONG_MIN, LLONG_MAX); }
+};
+
+// Converted without the C locale functions, as QCoreApplication sets LC_NUMERIC from the environment
+template <>
+struct pq_type<double>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "double precision"; }
+    static std::optional<std::string> encode(double value) {
+        if (std::isnan(value))
+            return std::string("NaN");
+        if (std::isinf(value))
+            return std::string(value > 0 ? "Infinity" : "-Infinity");
+        // The shortest text giving back the same value
+        char buffer[32];
+        std::to_chars_result result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        return std::string(buffer, result.ptr);
+    }
+    static double decode(const char *value, int length) {
+        // from_chars reads Infinity and NaN too, but not a leading +
+        double result;
+        std::from_chars_result parsed = std::from_chars(value, value + length, result);
+        if (parsed.ec != std::errc() || parsed.ptr != value + length)
+            _pqInvalidValue(name(), value, length);
+        return result;
+    }
+};
+
+template <>
+struct pq_type<bool>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "boolean"; }
+    static std::optional<std::string> encode(bool value) { return std::string(value ? "t" : "f"); }
+    static bool decode(const char *value, int length) {
+        if (length != 1 || (value[0] != 't' && value[0] != 'f'))
+            _pqInvalidValue(name(), value, length);
+        return value[0] == 't';
+    }
+};
+
+template <>
+struct pq_type<std::string>
+{
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "text"; }
+    static std::optional<std::string> encode(const std::string &value) { return value; }
+    static std::string decode(const char *value, int length) { return std::string(value, length); }
+};
+
+// NULL when empty
+template <typename T>
+struct pq_type<std::optional<T>>
+{
+    static constexpr bool known = pq_type<T>::known;
+    static constexpr const char *name() { return pq_type<T>::name(); }
+    static std::optional<std::string> encode(const std::optional<T> &value) {
+        if (!value)
+            return std::nullopt;
+        return pq_type<T>::encode(*value);
+    }
+    static std::optional<T> decode(const char *value, int length) { return pq_type<T>::decode(value, length); }
+    static std::optional<T> null() { return std::nullopt; }
+};
+
+// Value of a NULL field, the default constructed value unless the type has a null()
+template <typename T>
+inline auto _pqNull(int) -> decltype(pq_type<T>::null())
+{
+    return pq_type<T>::null();
+}
+
+template <typename T>
+inline T _pqNull(long)
+{
+    return T();
+}
+
+// One dimension arrays
+template <typename T>
+struct pq_type<std::vector<T>>
+{
+    static constexpr bool known = pq_type<T>::known;
+    static std::string typeName() { return std::string(pq_type<T>::name()) + "[]"; }
+    static const char *name() {
+        static const std::string result = typeName();
+        return result.c_str();
+    }
+
+    static std::optional<std::string> encode(const std::vector<T> &value) {
+        std::string result = "{";
+        bool first = true;
+        for (const T &item: value) {
+            if (!first)
+                result += ',';
+            first = false;
+            std::optional<std::string> text = pq_type<T>::encode(item);
+            if (!text) {
+                result += "NULL";
+                continue;
+            }
+            result += '"';
+            for (char c: *text) {
+                if (c == '"' || c == '\\')
+                    result += '\\';
+                result += c;
+            }
+            result += '"';
+        }
+        result += '}';
+        return result;
+    }
+
+    static std::vector<T> decode(const char *value, int length) {
+        std::vector<T> result;
+        if (length < 2 || value[0] != '{')
+            return result;
+        std::string item;
+        bool quoted = false;
+        bool wasQuoted = false;
+        for (int i = 1 ; i < length ; i++) {
+            char c = value[i];
+            if (quoted) {
+                if (c == '\\' && i + 1 < length)
+                    item += value[++i];
+                else if (c == '"')
+                    quoted = false;
+                else
+                    item += c;
+            } else if (c == '"') {
+                quoted = wasQuoted = true;
+            } else if (c == ',' || c == '}') {
+                if (!wasQuoted && item == "NULL")
+                    result.push_back(_pqNull<T>(0));
+                else if (wasQuoted || !item.empty())
+                    result.push_back(pq_type<T>::decode(item.c_str(), int(item.size())));
+                item.clear();
+                wasQuoted = false;
+            } else {
+                item += c;
+            }
+        }
+        return result;
+    }
+};
+
+// Days since 1970-01-01 of a proleptic gregorian date
+inline long long _pqDaysFromCivil(long long year, unsigned month, unsigned day)
+{
+    year -= month <= 2;
+    const long long era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned yearOfEra = unsigned(year - era * 400);
+    const unsigned dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + (long long)dayOfEra - 719468;
+}
+
+inline void _pqCivilFromDays(long long days, long long &year, unsigned &month, unsigned &day)
+{
+    days += 719468;
+    const long long era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned dayOfEra = unsigned(days - era * 146097);
+    const unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    const unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    const unsigned mp = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = (long long)yearOfEra + era * 400 + (month <= 2);
+}
+
+// Text of a timestamp with time zone given in microseconds since 1970-01-01 00:00:00 UTC
+inline std::string _pqEncodeTimestamp(long long micros)
+{
+    long long seconds = micros / 1000000;
+    long long fraction = micros % 1000000;
+    if (fraction < 0) {
+        fraction += 1000000;
+        seconds--;
+    }
+    long long days = seconds / 86400;
+    long long secondOfDay = seconds % 86400;
+    if (secondOfDay < 0) {
+        secondOfDay += 86400;
+        days--;
+    }
+    long long year;
+    unsigned month, day;
+    _pqCivilFromDays(days, year, month, day);
+    // There is no year 0, 1 BC comes right before 1 AD
+    const bool beforeChrist = year <= 0;
+    char buffer[64];
+    std::snprintf(buffer, sizeof(buffer), "%04lld-%02u-%02u %02lld:%02lld:%02lld.%06lld+00%s",
+                  beforeChrist ? 1 - year : year, month, day, secondOfDay / 3600, (secondOfDay / 60) % 60, secondOfDay % 60,
+                  fraction, beforeChrist ? " BC" : "");
+    return std::string(buffer);
+}
+
+// Microseconds since 1970-01-01 00:00:00 UTC of a finite timestamp with time zone, written with DateStyle ISO
+inline long long _pqDecodeTimestamp(const char *type, const char *value, int length)
+{
+    const char *end = value + length;
+    bool beforeChrist = false;
+    if (length > 3 && std::string(end - 3, 3) == " BC") {
+        beforeChrist = true;
+        end -= 3;
+    }
+
+    long long year = 0;
+    unsigned month = 1, day = 1, hour = 0, minute = 0, second = 0;
+    int consumed = 0;
+    // Years past 9999 have more digits
+    if (std::sscanf(value, "%lld-%2u-%2u %2u:%2u:%2u%n", &year, &month, &day, &hour, &minute, &second, &consumed) != 6
+            || consumed < 19 || value[0] < '0' || value[0] > '9' || year < 1
+            || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+        _pqInvalidValue(type, value, length);
+    if (beforeChrist)
+        year = 1 - year;
+    const char *cursor = value + consumed;
+
+    long long micros = 0;
+    if (*cursor == '.') {
+        long long scale = 100000;
+        for (cursor++ ; *cursor >= '0' && *cursor <= '9' ; cursor++, scale /= 10)
+            micros += (*cursor - '0') * scale;
+    }
+
+    // ISO output always ends with the UTC offset, as +HH, +HH:MM or +HH:MM:SS
+    if (*cursor != '+' && *cursor != '-')
+        _pqInvalidValue(type, value, length);
+    unsigned offsetHours = 0, offsetMinutes = 0, offsetSeconds = 0;
+    int offsetLength = 0;
+    if (std::sscanf(cursor + 1, "%2u%n:%2u%n:%2u%n", &offsetHours, &offsetLength,
+                    &offsetMinutes, &offsetLength, &offsetSeconds, &offsetLength) < 1
+            || cursor + 1 + offsetLength != end)
+        _pqInvalidValue(type, value, length);
+    long long offset = offsetHours * 3600 + offsetMinutes * 60 + offsetSeconds;
+    if (*cursor == '-')
+        offset = -offset;
+
+    // PostgreSQL stops at year 294276, far from overflowing
+    const long long seconds = _pqDaysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offset;
+    return seconds * 1000000 + micros;
+}
+
+/*
+ * timestamp with time zone, sent in UTC and read with the offset chosen by the server.
+ * infinity and -infinity are time_point::max() and time_point::min(), other values
+ * past the range of the clock throw SqlError.
+ */
+template <>
+struct pq_type<std::chrono::system_clock::time_point>
+{
+    typedef std::chrono::system_clock::time_point time_point;
+
+    static constexpr bool known = true;
+    static constexpr const char *name() { return "timestamp with time zone"; }
+
+    static std::optional<std::string> encode(const time_point &value) {
+        if (value == time_point::max())
+            return std::string("infinity");
+        if (value == time_point::min())
+            return std::string("-infinity");
+        return _pqEncodeTimestamp(std::chrono::duration_cast<std::chrono::microseconds>(value.time_since_epoch()).count());
+    }
+
+    static time_point decode(const char *value, int length) {
+        if (std::string(value, length) == "infinity")
+            return time_point::max();
+        if (std::string(value, length) == "-infinity")
+            return time_point::min();
+
+        const std::chrono::microseconds micros(_pqDecodeTimestamp(name(), value, length));
+        // The clock may count nanoseconds, which only covers the years 1677 to 2262
+        if (micros > std::chrono::duration_cast<std::chrono::microseconds>(time_point::duration::max())
+                || micros < std::chrono::duration_cast<std::chrono::microseconds>(time_point::duration::min()))
+            throw SqlError("Timestamp out of the range of std::chrono::system_clock: " + std::string(value, length));
+        return time_point(std::chrono::duration_cast<time_point::duration>(micros));
+    }
+};
+
+#endif // PQTYPES_H
@@ -33,6 +33,7 @@
 #include <QSqlRecord>
 #include <QMetaProperty>
 #include <QJsonDocument>
+#include <QStringList>
 
 #include <tuple>
 
@@ -234,4 +235,53 @@ public:
     }
 };
 
+/*
+ * Columns actually read by SqlQueryResultMapper<T>, so that the mapper selects
+ * them instead of the whole function result.
+ * outputColumns are the columns returned by the function, as found in the
+ * catalog (empty if unknown). An empty list means SELECT *.
+ * Specialize it next to any custom result mapping.
+ */
+template <typename T, typename Enable = void>
+struct SqlResultColumns
+{
+    static constexpr bool needsCatalog = false;
+    static QStringList columns(const QStringList &) { return QStringList(); }
+};
+
+// QObject: the properties declared by the class and returned by the function
+template <typename T>
+struct SqlResultColumns<T, typename std::enable_if<std::is_base_of<QObject, typename std::remove_pointer<T>::type>::value>::type>
+{
+    static constexpr bool needsCatalog = true;
+    static QStringList columns(const QStringList &outputColumns) {
+        QStringList result;
+        const QMetaObject &metaObject = std::remove_pointer<T>::type::staticMetaObject;
+        for (int i = QObject::staticMetaObject.propertyCount() ; i < metaObject.propertyCount() ; i++)
+        {
+            QString name = QString::fromLatin1(metaObject.property(i).name());
+            if (outputColumns.contains(name))
+                result << name;
+        }
+        return result;
+    }
+};
+
+// Tuples are mapped by position: the first columns returned by the function
+template <typename ...Args>
+struct SqlResultColumns<std::tuple<Args...>>
+{
+    static constexpr bool needsCatalog = true;
+    static QStringList columns(const QStringList &outputColumns) {
+        if (outputColumns.size() <= int(sizeof...(Args)))
+            return QStringList();
+        return outputColumns.mid(0, sizeof...(Args));
+    }
+};
+
+template <typename T>
+struct SqlResultColumns<QList<T>> : public SqlResultColumns<T>
+{
+};
+
 #endif // QUERYRESULT_H
@@ -0,0 +1,232 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SQLCANCEL_H
+#define SQLCANCEL_H
+
+#include <libpq-fe.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// State shared between a SqlCancelGuard and the watchdog
+struct _SqlCancelState
+{
+    explicit _SqlCancelState(PGconn *connection)
+        : cancel(connection ? PQgetCancel(connection) : nullptr),
+          done(false),
+          expired(false),
+          cancelled(false)
+    {}
+
+    ~_SqlCancelState() {
+        if (cancel)
+            PQfreeCancel(cancel);
+    }
+
+    // Send a cancel request unless the statement is already over
+    void sendCancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        char errorBuffer[256];
+        if (!done && cancel)
+            PQcancel(cancel, errorBuffer, sizeof(errorBuffer));
+    }
+
+    PGcancel *cancel;
+    std::mutex mutex;
+    bool done;
+    std::atomic<bool> expired;
+    std::atomic<bool> cancelled;
+};
+
+/*
+ * One thread for the whole process, sending the cancel requests of the
+ * statements whose deadline expired. It is started with the first deadline.
+ */
+class SqlWatchdog
+{
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+    typedef std::multimap<time_point, std::shared_ptr<_SqlCancelState>> Queue;
+
+    static SqlWatchdog &instance() {
+        static SqlWatchdog watchdog;
+        return watchdog;
+    }
+
+    ~SqlWatchdog() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_changed.notify_all();
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+    Queue::iterator watch(time_point deadline, const std::shared_ptr<_SqlCancelState> &state) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_thread.joinable())
+            m_thread = std::thread(&SqlWatchdog::_run, this);
+        Queue::iterator it = m_queue.emplace(deadline, state);
+        if (it == m_queue.begin())
+            m_changed.notify_all();
+        return it;
+    }
+
+    // Stop watching a statement, returns false if its deadline already expired
+    bool forget(Queue::iterator it, const _SqlCancelState *state) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // Expired entries were already removed from the queue by the watchdog
+        if (state->expired)
+            return false;
+        m_queue.erase(it);
+        return true;
+    }
+
+private:
+    SqlWatchdog() : m_stopping(false) {}
+
+    void _run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stopping) {
+            if (m_queue.empty()) {
+                m_changed.wait(lock);
+                continue;
+            }
+            time_point deadline = m_queue.begin()->first;
+            if (std::chrono::steady_clock::now() < deadline) {
+                m_changed.wait_until(lock, deadline);
+                continue;
+            }
+            std::shared_ptr<_SqlCancelState> state = m_queue.begin()->second;
+            m_queue.erase(m_queue.begin());
+            state->expired = true;
+            // The cancel request opens a connection to the server, do not block the queue meanwhile
+            lock.unlock();
+            state->sendCancel();
+            lock.lock();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    Queue m_queue;
+    bool m_stopping;
+    std::thread m_thread;
+};
+
+/*
+ * Watches one statement running on a libpq connection.
+ * A cancel request is sent to the server when the deadline expires or when
+ * cancel() is called from another thread.
+ */
+class SqlCancelGuard
+{
+public:
+    SqlCancelGuard(PGconn *connection, std::chrono::milliseconds timeout)
+        : m_state(std::make_shared<_SqlCancelState>(connection)),
+          m_watched(m_state->cancel && timeout.count() > 0)
+    {
+        if (m_watched)
+            m_entry = SqlWatchdog::instance().watch(std::chrono::steady_clock::now() + timeout, m_state);
+    }
+
+    ~SqlCancelGuard()
+    {
+        if (m_watched)
+            SqlWatchdog::instance().forget(m_entry, m_state.get());
+        // Waits for a cancel request being sent for this statement
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        m_state->done = true;
+    }
+
+    SqlCancelGuard(const SqlCancelGuard &) = delete;
+    SqlCancelGuard &operator=(const SqlCancelGuard &) = delete;
+
+    void cancel()
+    {
+        m_state->cancelled = true;
+        m_state->sendCancel();
+    }
+
+    bool deadlineExpired() const { return m_state->expired; }
+    bool cancelled() const { return m_state->cancelled; }
+
+private:
+    std::shared_ptr<_SqlCancelState> m_state;
+    bool m_watched;
+    SqlWatchdog::Queue::iterator m_entry;
+};
+
+/*
+ * The call a mapper is currently running, so that it can be cancelled from
+ * another thread.
+ */
+class SqlRunningCall
+{
+public:
+    SqlRunningCall() : m_guard(nullptr) {}
+
+    SqlRunningCall(const SqlRunningCall &) = delete;
+    SqlRunningCall &operator=(const SqlRunningCall &) = delete;
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_guard)
+            m_guard->cancel();
+    }
+
+    // Registers the guard as the running call for its lifetime
+    class Scope
+    {
+    public:
+        Scope(SqlRunningCall &call, SqlCancelGuard &guard) : m_call(call) {
+            std::lock_guard<std::mutex> lock(m_call.m_mutex);
+            m_call.m_guard = &guard;
+        }
+        ~Scope() {
+            std::lock_guard<std::mutex> lock(m_call.m_mutex);
+            m_call.m_guard = nullptr;
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        SqlRunningCall &m_call;
+    };
+
+private:
+    std::mutex m_mutex;
+    SqlCancelGuard *m_guard;
+};
+
+#endif // SQLCANCEL_H
@@ -0,0 +1,74 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SQLCATALOG_H
+#define SQLCATALOG_H
+
+#include <QSqlDatabase>
+#include <QSqlDriver>
+#include <QVariant>
+#include <QStringList>
+
+#include <libpq-fe.h>
+
+#include "pqcatalog.h"
+
+// libpq connection behind a QPSQL database, nullptr for other drivers
+inline PGconn *_pgConnection(const QSqlDatabase &db)
+{
+    QVariant handle = db.driver()->handle();
+    if (handle.isValid() && qstrcmp(handle.typeName(), "PGconn*") == 0)
+        return *static_cast<PGconn **>(handle.data());
+    return nullptr;
+}
+
+struct SqlFunctionInfo
+{
+    SqlFunctionInfo() : volatility(SqlVolatility::Unknown) {}
+
+    SqlVolatility volatility;
+    // Names of the columns returned by the function, empty when unknown or not a composite result
+    QStringList outputColumns;
+};
+
+/*
+ * Look up a function in pg_catalog, see _pqLookupFunction.
+ * Returns false without doing anything unless the connection is idle.
+ */
+inline bool _lookupFunction(const QSqlDatabase &db, const QString &schemaName, const QString &functionName,
+                            int argCount, SqlFunctionInfo &info)
+{
+    PqFunctionInfo pqInfo;
+    if (!_pqLookupFunction(_pgConnection(db), schemaName.toStdString(), functionName.toStdString(), argCount, pqInfo))
+        return false;
+
+    info = SqlFunctionInfo();
+    info.volatility = pqInfo.volatility;
+    for (const std::string &column: pqInfo.outputColumns)
+        info.outputColumns << QString::fromStdString(column);
+    return true;
+}
+
+#endif // SQLCATALOG_H
@@ -0,0 +1,99 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SQLERROR_H
+#define SQLERROR_H
+
+#include <stdexcept>
+#include <string>
+
+/*
+ * Errors raised by the mappers when a call fails.
+ * They only depend on the standard library so that any layer can throw or
+ * catch them.
+ */
+class SqlError : public std::runtime_error
+{
+public:
+    explicit SqlError(const std::string &message, const std::string &sqlState = std::string())
+        : std::runtime_error(message),
+          m_sqlState(sqlState)
+    {}
+
+    // SQLSTATE reported by PostgreSQL, empty if the failure happened client side
+    const std::string &sqlState() const { return m_sqlState; }
+
+private:
+    std::string m_sqlState;
+};
+
+// The connection is broken or could not be used, the call may be retried elsewhere
+class SqlConnectionError : public SqlError
+{
+public:
+    using SqlError::SqlError;
+};
+
+// The call ran past its deadline, either on the server (statement_timeout) or on the client
+class SqlTimeoutError : public SqlError
+{
+public:
+    using SqlError::SqlError;
+};
+
+// The call was cancelled on request
+class SqlCancelledError : public SqlError
+{
+public:
+    using SqlError::SqlError;
+};
+
+inline bool _isConnectionSqlState(const std::string &sqlState)
+{
+    // Class 08 (connection exception) and 57P01..57P03 (shutdown, cannot connect now)
+    return sqlState.compare(0, 2, "08") == 0 || sqlState.compare(0, 4, "57P0") == 0;
+}
+
+/*
+ * Throw the SqlError subclass matching a failed call.
+ * cancelled and deadlineExpired tell whether the client asked for the cancellation,
+ * hasDeadline whether a statement_timeout was set for the call.
+ */
+[[noreturn]] inline void _throwSqlError(const std::string &message, const std::string &sqlState,
+                                        bool cancelled, bool deadlineExpired, bool hasDeadline, bool connectionLost)
+{
+    if (cancelled)
+        throw SqlCancelledError(message, sqlState);
+    // 57014 is query_canceled, raised both by statement_timeout and by cancel requests
+    if (deadlineExpired || (sqlState == "57014" && hasDeadline))
+        throw SqlTimeoutError(message, sqlState);
+    if (sqlState == "57014")
+        throw SqlCancelledError(message, sqlState);
+    if (connectionLost || _isConnectionSqlState(sqlState))
+        throw SqlConnectionError(message, sqlState);
+    throw SqlError(message, sqlState);
+}
+
+#endif // SQLERROR_H
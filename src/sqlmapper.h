@@ -33,10 +33,17 @@
 #include <QSqlDriver>
 #include <QJsonDocument>
 #include <QVector>
+#include <QHash>
 #include <tuple>
 
 #include "queryresult.h"
 #include "pg_types.h"
+#include "sqlerror.h"
+#include "sqlcancel.h"
+#include "pqsession.h"
+#include "sqlcatalog.h"
+#include "sqlrouter.h"
+#include "sqltracer.h"
 
 template<typename T>
 inline void _queryBind(QSqlQuery *query, const T &value)
@@ -82,6 +89,10 @@ _queryBind(QSqlQuery *query, const std::tuple<Args...> &value)
     _queryBind<Idx+1>(query, value);
 }
 
+inline void _queryBind(QSqlQuery *)
+{
+}
+
 template<typename T, typename... Args>
 inline void _queryBind(QSqlQuery *query, T value, Args... args)
 {
@@ -161,24 +172,43 @@ _buildPlaceholders()
 
 
 
+// Quoted select list for the given columns, * when there is no column
+inline QString _buildSelectList(const QStringList &columns)
+{
+    if (columns.isEmpty())
+        return QStringLiteral("*");
+    QStringList quoted;
+    for (const QString &column: columns)
+        quoted << QString("\"%1\"").arg(QString(column).replace("\"", "\"\""));
+    return quoted.join(", ");
+}
+
 template<typename... Args>
-inline QString _buildQuery(const QString &functionName)
+inline QString _buildQuery(const QString &functionName, const QString &selectList = QStringLiteral("*"))
 {
     if (sizeof...(Args) == 0) {
-        return QString("SELECT * FROM %1();").arg(functionName);
+        return QString("SELECT %1 FROM %2();").arg(selectList, functionName);
     } else {
         QString placeHolders = _buildPlaceholders<Args...>();
-        qDebug() << QString("SELECT * FROM %1(%2);").arg(functionName).arg(placeHolders);
-        return QString("SELECT * FROM %1(%2);").arg(functionName).arg(placeHolders);
+        return QString("SELECT %1 FROM %2(%3);").arg(selectList, functionName, placeHolders);
     }
 }
 
-inline QString _buildQuery(const QString &functionName)
+inline QString _buildQuery(const QString &functionName, const QString &selectList = QStringLiteral("*"))
 {
-    return QString("SELECT * FROM %1();").arg(functionName);
+    return QString("SELECT %1 FROM %2();").arg(selectList, functionName);
 }
 
-
+// On a dead socket QPSQL reports a StatementError without SQLSTATE, so the libpq connection status is checked too
+[[noreturn]] inline void _throwQueryError(const QSqlDatabase &db, const QSqlQuery &query,
+                                          const SqlCancelGuard *guard = nullptr, int timeout = 0)
+{
+    QSqlError error = query.lastError();
+    PGconn *connection = _pgConnection(db);
+    _throwSqlError(error.text().toStdString(), error.nativeErrorCode().toStdString(),
+                   guard && guard->cancelled(), guard && guard->deadlineExpired(), timeout > 0,
+                   error.type() == QSqlError::ConnectionError || (connection && PQstatus(connection) == CONNECTION_BAD));
+}
 
 
 
@@ -192,7 +222,24 @@ public:
     SqlBindingMapper(const char *connectionName, const QString &schemaName, const QString &functionName)
         : m_schemaName(schemaName),
           m_functionName(functionName),
-          m_preparedQuery(QSqlDatabase::database(connectionName))
+          m_database(QSqlDatabase::database(connectionName)),
+          m_preparedQuery(m_database),
+          m_router(nullptr),
+          m_volatility(SqlVolatility::Unknown),
+          m_functionInfoLoaded(false),
+          m_tracer(nullptr),
+          m_timeout(0)
+    {}
+
+    // Calls are spread by the router between its primary and replicas, depending on the function volatility
+    SqlBindingMapper(SqlConnectionRouter *router, const QString &schemaName, const QString &functionName)
+        : m_schemaName(schemaName),
+          m_functionName(functionName),
+          m_router(router),
+          m_volatility(SqlVolatility::Unknown),
+          m_functionInfoLoaded(false),
+          m_tracer(nullptr),
+          m_timeout(0)
     {}
 
     ~SqlBindingMapper() { }
@@ -200,24 +247,71 @@ public:
     template<typename R=T>
     typename std::enable_if<(sizeof...(Arguments) != 0), R>::type
     operator() (Arguments... params) {
-        if (!m_preparedQuery.isValid())
-            m_preparedQuery.prepare(_buildQuery<Arguments...>(sqlFunctionName()));
-        _queryBind(&m_preparedQuery, params...);
-
-        _exec();
-
-        return m_mapper.map(&m_preparedQuery);
+        return callWithTimeout(m_timeout, params...);
     }
 
     template<typename R=T>
     typename std::enable_if<(sizeof...(Arguments) == 0), R>::type
     operator() () {
-        if (!m_preparedQuery.isValid())
-            m_preparedQuery.prepare(_buildQuery(sqlFunctionName()));
+        return callWithTimeout(m_timeout);
+    }
 
-        _exec();
+    // Same as operator(), with a deadline in milliseconds overriding the mapper one for this call only
+    T callWithTimeout (int msecs, Arguments... params) {
+        if (!m_router)
+            return _call(m_database, m_preparedQuery, msecs, params...);
+
+        {
+            SqlConnectionRouter::Lease lease = m_router->acquire(volatility());
+            try {
+                return _call(lease.database(), _routedQuery(lease), msecs, params...);
+            } catch (const SqlConnectionError &) {
+                if (!lease.isReplica())
+                    throw;
+                lease.markFailed();
+            }
+        }
+        // The replica went away, the primary can always serve the call
+        SqlConnectionRouter::Lease lease = m_router->acquirePrimary();
+        return _call(lease.database(), _routedQuery(lease), msecs, params...);
+    }
 
-        return m_mapper.map(&m_preparedQuery);
+    // Deadline in milliseconds applied to every call, 0 (the default) means no deadline.
+    // It is enforced both by the server statement_timeout and by a client side cancel request.
+    void setTimeout(int msecs) { m_timeout = msecs; }
+    int timeout() const { return m_timeout; }
+
+    // Declare the function volatility instead of reading it from pg_proc on the first routed call
+    void setVolatility(SqlVolatility volatility) { m_volatility = volatility; }
+    SqlVolatility volatility() {
+        if (m_volatility == SqlVolatility::Unknown && m_router) {
+            SqlVolatility volatility = _functionInfo().volatility;
+            // The lookup is done again on the next call when it was skipped
+            if (!m_functionInfoLoaded)
+                return SqlVolatility::Volatile;
+            m_volatility = volatility;
+            // Unknown functions may have side effects, keep them on the primary
+            if (m_volatility == SqlVolatility::Unknown)
+                m_volatility = SqlVolatility::Volatile;
+        }
+        return m_volatility;
+    }
+
+    // Declare the columns to select instead of deriving them from the result type and the catalog.
+    // Tuples are mapped by position, so the names must be given in the tuple order.
+    void setResultColumns(const QStringList &columns) {
+        m_resultColumns = columns;
+        m_callSql.clear();
+    }
+    QStringList resultColumns() const { return m_resultColumns; }
+
+    // Slow calls are recorded by the tracer, nullptr (the default) disables tracing
+    void setTracer(SqlCallTracer *tracer) { m_tracer = tracer; }
+    SqlCallTracer *tracer() const { return m_tracer; }
+
+    // Cancel the call currently running, if any. May be called from any thread.
+    void cancel() {
+        m_runningCall.cancel();
     }
 
     QString sqlFunctionName() const {
@@ -229,17 +323,130 @@ public:
 
 private:
 
-    inline void _exec() {
-        if (!m_preparedQuery.exec()) {
-            qDebug() << "Got a database failure :" << m_preparedQuery.lastError().text();
-            qFatal("Stopping for database issue");
+    const SqlFunctionInfo &_functionInfo() {
+        if (!m_functionInfoLoaded) {
+            QSqlDatabase db = m_router ? QSqlDatabase::database(m_router->primaryConnectionName()) : m_database;
+            // The lookup is only an optimization, a failure falls back to the safe defaults.
+            // It is skipped inside transactions, where a failure would abort the caller's transaction,
+            // and done again on a later call after a connection error.
+            try {
+                m_functionInfoLoaded = _lookupFunction(db, m_schemaName, m_functionName, sizeof...(Arguments), m_functionInfo);
+            } catch (const SqlConnectionError &) {
+                m_functionInfo = SqlFunctionInfo();
+            } catch (const SqlError &) {
+                m_functionInfo = SqlFunctionInfo();
+                m_functionInfoLoaded = true;
+            }
+        }
+        return m_functionInfo;
+    }
+
+    QString _selectList() {
+        if (!m_resultColumns.isEmpty())
+            return _buildSelectList(m_resultColumns);
+        if (!SqlResultColumns<T>::needsCatalog)
+            return QStringLiteral("*");
+        return _buildSelectList(SqlResultColumns<T>::columns(_functionInfo().outputColumns));
+    }
+
+    template<typename R=T>
+    typename std::enable_if<(sizeof...(Arguments) != 0), QString>::type
+    _buildCallQuery() {
+        return _buildQuery<Arguments...>(sqlFunctionName(), _selectList());
+    }
+
+    template<typename R=T>
+    typename std::enable_if<(sizeof...(Arguments) == 0), QString>::type
+    _buildCallQuery() {
+        return _buildQuery(sqlFunctionName(), _selectList());
+    }
+
+    QString _callQuery() {
+        if (!m_callSql.isEmpty())
+            return m_callSql;
+        QString sql = _buildCallQuery();
+        // Without the catalog, the query is built again until the lookup could be done
+        if (m_functionInfoLoaded || !m_resultColumns.isEmpty() || !SqlResultColumns<T>::needsCatalog)
+            m_callSql = sql;
+        return sql;
+    }
+
+    QSqlQuery &_routedQuery(const SqlConnectionRouter::Lease &lease) {
+        auto it = m_routedQueries.find(lease.connectionName());
+        if (it == m_routedQueries.end())
+            it = m_routedQueries.insert(lease.connectionName(), QSqlQuery(lease.database()));
+        return it.value();
+    }
+
+    T _call(const QSqlDatabase &db, QSqlQuery &query, int msecs, Arguments... params) {
+        if (m_tracer && m_tracer->sample())
+            return _tracedCall(db, query, msecs, params...);
+
+        const QString sql = _callQuery();
+        if (!query.isValid() || query.lastQuery() != sql)
+            _prepare(db, query, sql);
+        _queryBind(&query, params...);
+
+        _exec(db, query, msecs);
+
+        return m_mapper.map(&query);
+    }
+
+    T _tracedCall(const QSqlDatabase &db, QSqlQuery &query, int msecs, Arguments... params) {
+        const QString sql = _callQuery();
+        SqlTracedCall call(m_tracer, db, sqlFunctionName(), sql);
+        try {
+            if (!query.isValid() || query.lastQuery() != sql)
+                _prepare(db, query, sql);
+            call.prepared();
+            _queryBind(&query, params...);
+            call.bound(query);
+
+            _exec(db, query, msecs);
+        } catch (const SqlError &error) {
+            call.failed(error);
+            throw;
+        }
+        call.executed(query);
+
+        return m_mapper.map(&query);
+    }
+
+    inline void _prepare(const QSqlDatabase &db, QSqlQuery &query, const QString &sql) {
+        if (!query.prepare(sql))
+            _throwQueryError(db, query);
+    }
+
+    inline void _exec(const QSqlDatabase &db, QSqlQuery &query, int msecs) {
+        // statement_timeout is set directly through libpq, on the connection used by QPSQL
+        PGconn *connection = _pgConnection(db);
+        PqStatementTimeout statementTimeout(connection, msecs);
+
+        SqlCancelGuard guard(connection, std::chrono::milliseconds(msecs));
+        bool ok;
+        {
+            SqlRunningCall::Scope running(m_runningCall, guard);
+            ok = query.exec();
         }
+        if (!ok)
+            _throwQueryError(db, query, &guard, msecs);
     }
 
     QString m_schemaName;
     QString m_functionName;
     SqlQueryResultMapper<T> m_mapper;
+    QSqlDatabase m_database;
     QSqlQuery m_preparedQuery;
+    SqlConnectionRouter *m_router;
+    QHash<QString, QSqlQuery> m_routedQueries;
+    SqlVolatility m_volatility;
+    SqlFunctionInfo m_functionInfo;
+    bool m_functionInfoLoaded;
+    QStringList m_resultColumns;
+    QString m_callSql;
+    SqlCallTracer *m_tracer;
+    int m_timeout;
+    SqlRunningCall m_runningCall;
 };
 
 
@@ -0,0 +1,295 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SQLROUTER_H
+#define SQLROUTER_H
+
+#include <QSqlDatabase>
+#include <QString>
+
+#include <libpq-fe.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pqresult.h"
+#include "sqlcatalog.h"
+#include "sqlcancel.h"
+
+/*
+ * Routes the calls of SqlBindingMapper between a primary and read replicas.
+ * STABLE and IMMUTABLE functions go to the healthy replicas in turn,
+ * everything else stays on the primary. While the primary
+ * connection is inside a transaction every call stays on the primary, so that
+ * reads see the writes of that transaction.
+ * The health and lag of the replicas are checked by a background thread, over
+ * libpq connections of its own, so that a dead replica never delays a call.
+ * The connections used by the calls are regular QSqlDatabase connections, so
+ * the router must be used from the thread owning them. Calls are synchronous,
+ * so there is never more than one in flight to balance between the replicas.
+ */
+class SqlConnectionRouter
+{
+    struct Node
+    {
+        Node(const QString &name, const std::string &info)
+            : connectionName(name), connectionInfo(info), healthy(false), lagMsecs(0), probeConnection(nullptr) {}
+
+        QString connectionName;
+        std::string connectionInfo;
+        bool healthy;
+        qint64 lagMsecs;
+        // Only used by the health check thread
+        PGconn *probeConnection;
+    };
+
+public:
+    // The node chosen for one call
+    class Lease
+    {
+    public:
+        const QString &connectionName() const { return m_node->connectionName; }
+        QSqlDatabase database() const { return QSqlDatabase::database(m_node->connectionName); }
+        bool isReplica() const { return m_node != m_router->m_primary.get(); }
+
+        // The node failed to serve the call, keep it out of the rotation until a health check succeeds
+        void markFailed() { m_router->_markFailed(m_node); }
+
+    private:
+        friend class SqlConnectionRouter;
+        Lease(SqlConnectionRouter *router, Node *node) : m_router(router), m_node(node) {}
+
+        SqlConnectionRouter *m_router;
+        Node *m_node;
+    };
+
+    explicit SqlConnectionRouter(const QString &primaryConnectionName = QSqlDatabase::defaultConnection)
+        : m_primary(new Node(primaryConnectionName, std::string())),
+          m_maxReplicationLag(0),
+          m_healthCheckInterval(5000),
+          m_healthCheckTimeout(1000),
+          m_nextReplica(0),
+          m_stopping(false)
+    {}
+
+    ~SqlConnectionRouter() {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stopping = true;
+        }
+        m_wakeUp.notify_all();
+        if (m_healthChecks.joinable())
+            m_healthChecks.join();
+        for (const std::unique_ptr<Node> &node: m_replicas)
+            PQfinish(node->probeConnection);
+    }
+
+    SqlConnectionRouter(const SqlConnectionRouter &) = delete;
+    SqlConnectionRouter &operator=(const SqlConnectionRouter &) = delete;
+
+    // The replica receives calls once its first health check succeeded
+    void addReplica(const QString &connectionName) {
+        std::string info = _connectionInfo(QSqlDatabase::database(connectionName, false));
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_replicas.emplace_back(new Node(connectionName, info));
+            if (!m_healthChecks.joinable())
+                m_healthChecks = std::thread(&SqlConnectionRouter::_healthCheckLoop, this);
+        }
+        m_wakeUp.notify_all();
+    }
+
+    // Replicas lagging more than msecs behind the primary are skipped, 0 (the default) means no limit
+    void setMaxReplicationLag(int msecs) { m_maxReplicationLag = msecs; }
+    int maxReplicationLag() const { return m_maxReplicationLag; }
+
+    // How often the state and lag of each replica is refreshed
+    void setHealthCheckInterval(int msecs) { m_healthCheckInterval = msecs; }
+    int healthCheckInterval() const { return m_healthCheckInterval; }
+
+    // Bound for the query of a health check. When the check connects to the replica,
+    // connect_timeout is added to the connection options that have none.
+    void setHealthCheckTimeout(int msecs) { m_healthCheckTimeout = msecs; }
+    int healthCheckTimeout() const { return m_healthCheckTimeout; }
+
+    QString primaryConnectionName() const { return m_primary->connectionName; }
+
+    Lease acquirePrimary() {
+        return Lease(this, m_primary.get());
+    }
+
+    Lease acquire(SqlVolatility volatility) {
+        if (volatility != SqlVolatility::Stable && volatility != SqlVolatility::Immutable)
+            return acquirePrimary();
+        // A replica would not see the uncommitted writes of a transaction open on the primary
+        PGconn *primary = _pgConnection(QSqlDatabase::database(m_primary->connectionName, false));
+        if (primary && PQtransactionStatus(primary) != PQTRANS_IDLE)
+            return acquirePrimary();
+
+        Node *best = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            const std::size_t count = m_replicas.size();
+            // The first usable replica after the previous one
+            for (std::size_t i = 0 ; i < count && !best ; i++) {
+                Node *node = m_replicas[(m_nextReplica + i) % count].get();
+                if (_usable(node)) {
+                    best = node;
+                    m_nextReplica += i + 1;
+                }
+            }
+        }
+        if (!best)
+            return acquirePrimary();
+
+        // Connections closed by markFailed() are opened again once the replica is back
+        QSqlDatabase db = QSqlDatabase::database(best->connectionName, false);
+        if (!db.isOpen() && !db.open()) {
+            _markFailed(best);
+            return acquirePrimary();
+        }
+        return Lease(this, best);
+    }
+
+private:
+    bool _usable(const Node *node) const {
+        return node->healthy && (m_maxReplicationLag <= 0 || node->lagMsecs <= m_maxReplicationLag);
+    }
+
+    void _markFailed(Node *node) {
+        if (node == m_primary.get())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            node->healthy = false;
+        }
+        // QPSQL still reports the connection open after the server restarted
+        QSqlDatabase::database(node->connectionName, false).close();
+    }
+
+    // libpq connection string of a QPSQL database, with the same options QPSQL uses
+    static std::string _connectionInfo(const QSqlDatabase &db) {
+        auto quote = [](const QString &value) {
+            std::string result = "'";
+            for (char c: value.toStdString()) {
+                if (c == '\'' || c == '\\')
+                    result += '\\';
+                result += c;
+            }
+            return result + "'";
+        };
+        std::string info;
+        if (!db.hostName().isEmpty())
+            info += " host=" + quote(db.hostName());
+        if (db.port() != -1)
+            info += " port=" + std::to_string(db.port());
+        if (!db.databaseName().isEmpty())
+            info += " dbname=" + quote(db.databaseName());
+        if (!db.userName().isEmpty())
+            info += " user=" + quote(db.userName());
+        if (!db.password().isEmpty())
+            info += " password=" + quote(db.password());
+        if (!db.connectOptions().isEmpty())
+            info += " " + QString(db.connectOptions()).replace(';', ' ').toStdString();
+        return info;
+    }
+
+    void _healthCheckLoop() {
+        std::unique_lock<std::mutex> lock(m_lock);
+        while (!m_stopping) {
+            std::vector<Node *> nodes;
+            for (const std::unique_ptr<Node> &node: m_replicas)
+                nodes.push_back(node.get());
+            lock.unlock();
+
+            for (Node *node: nodes) {
+                qint64 lagMsecs = 0;
+                const bool healthy = _probe(node, lagMsecs);
+                lock.lock();
+                node->healthy = healthy;
+                node->lagMsecs = lagMsecs;
+                const bool stopping = m_stopping;
+                lock.unlock();
+                if (stopping)
+                    break;
+            }
+
+            lock.lock();
+            m_wakeUp.wait_for(lock, std::chrono::milliseconds(int(m_healthCheckInterval)), [this] { return m_stopping; });
+        }
+    }
+
+    bool _probe(Node *node, qint64 &lagMsecs) {
+        const int timeout = m_healthCheckTimeout;
+        if (node->probeConnection && PQstatus(node->probeConnection) != CONNECTION_OK) {
+            PQfinish(node->probeConnection);
+            node->probeConnection = nullptr;
+        }
+        if (!node->probeConnection) {
+            std::string info = node->connectionInfo;
+            // libpq waits at least two seconds
+            if (info.find("connect_timeout") == std::string::npos)
+                info += " connect_timeout=" + std::to_string(std::max(2, (timeout + 999) / 1000));
+            node->probeConnection = PQconnectdb(info.c_str());
+            if (PQstatus(node->probeConnection) != CONNECTION_OK)
+                return false;
+        }
+
+        // The replay timestamp does not move while the primary is idle, so a fully replayed replica has no lag
+        SqlCancelGuard guard(node->probeConnection, std::chrono::milliseconds(timeout));
+        PqResult result(PQexec(node->probeConnection,
+                               "SELECT CASE WHEN NOT pg_catalog.pg_is_in_recovery() "
+                               "OR pg_catalog.pg_last_wal_receive_lsn() = pg_catalog.pg_last_wal_replay_lsn() THEN 0 "
+                               "ELSE COALESCE(EXTRACT(EPOCH FROM now() - pg_catalog.pg_last_xact_replay_timestamp()) * 1000, 0) END::bigint;"));
+        if (PQresultStatus(result.get()) != PGRES_TUPLES_OK || PQntuples(result.get()) != 1)
+            return false;
+        try {
+            lagMsecs = _pqDecode<long long>(result.get(), 0, 0);
+        } catch (const SqlError &) {
+            return false;
+        }
+        return true;
+    }
+
+    std::unique_ptr<Node> m_primary;
+    std::vector<std::unique_ptr<Node>> m_replicas;
+    int m_maxReplicationLag;
+    std::atomic<int> m_healthCheckInterval;
+    std::atomic<int> m_healthCheckTimeout;
+    std::size_t m_nextReplica;
+    bool m_stopping;
+    std::mutex m_lock;
+    std::condition_variable m_wakeUp;
+    std::thread m_healthChecks;
+};
+
+#endif // SQLROUTER_H
@@ -0,0 +1,301 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SQLTRACER_H
+#define SQLTRACER_H
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSqlDatabase>
+#include <QSqlDriver>
+#include <QSqlError>
+#include <QSqlField>
+#include <QSqlQuery>
+#include <QSqlResult>
+#include <QStringList>
+
+#include <libpq-fe.h>
+
+#include <atomic>
+
+#include "sqlerror.h"
+#include "sqlcatalog.h"
+
+// Replace the ? placeholders, outside of quoted identifiers, by the given literals
+inline QString _inlineQueryArguments(const QString &query, const QStringList &arguments)
+{
+    QString result;
+    bool quoted = false;
+    int argument = 0;
+    for (QChar c: query) {
+        if (c == '"')
+            quoted = !quoted;
+        if (c == '?' && !quoted && argument < arguments.size())
+            result += arguments[argument++];
+        else
+            result += c;
+    }
+    return result;
+}
+
+// What is known of one traced call
+struct SqlCallTrace
+{
+    SqlCallTrace() : prepareNsecs(0), bindNsecs(0), execNsecs(0), mapNsecs(0), rows(-1), bytes(-1) {}
+
+    qint64 totalNsecs() const { return prepareNsecs + bindNsecs + execNsecs + mapNsecs; }
+
+    QDateTime startTime;
+    QString connectionName;
+    QString functionName;
+    QString query;
+    QStringList arguments;
+    qint64 prepareNsecs;
+    qint64 bindNsecs;
+    qint64 execNsecs;
+    qint64 mapNsecs;
+    int rows;
+    qint64 bytes;
+    QString error;
+    QStringList plan;
+};
+
+/*
+ * Records the calls of the mappers it is set on that run slower than a threshold.
+ * Each slow call is written as one JSON line to a file, rotated once it grows
+ * past maxFileSize().
+ */
+class SqlCallTracer
+{
+public:
+    explicit SqlCallTracer(const QString &fileName)
+        : m_fileName(fileName),
+          m_sampleInterval(1),
+          m_threshold(100),
+          m_explainSlowCalls(false),
+          m_maxFileSize(10 * 1024 * 1024),
+          m_maxFiles(5),
+          m_callCount(0)
+    {}
+
+    // Only one call out of n is measured, 1 (the default) measures them all
+    void setSampleInterval(int n) { m_sampleInterval = qMax(1, n); }
+    int sampleInterval() const { return m_sampleInterval; }
+
+    // Measured calls taking more than msecs are recorded, 100 by default
+    void setThreshold(int msecs) { m_threshold = msecs; }
+    int threshold() const { return m_threshold; }
+
+    // Run slow calls again under EXPLAIN (ANALYZE, BUFFERS) to record their plan.
+    // The statement runs a second time in a transaction that is rolled back, so this is
+    // only done when the connection is not already in a transaction. Side effects escaping
+    // transactions (sequences, external calls...) happen twice.
+    // The replay is synchronous: a slow call only returns once it was run again, so its
+    // latency is about doubled. Use a sample interval keeping this rare enough.
+    void setExplainSlowCalls(bool explain) { m_explainSlowCalls = explain; }
+    bool explainSlowCalls() const { return m_explainSlowCalls; }
+
+    void setMaxFileSize(qint64 bytes) { m_maxFileSize = bytes; }
+    qint64 maxFileSize() const { return m_maxFileSize; }
+
+    // Number of rotated files kept next to the trace file (fileName.1, fileName.2...)
+    void setMaxFiles(int count) { m_maxFiles = count; }
+    int maxFiles() const { return m_maxFiles; }
+
+    bool sample() {
+        return (m_callCount++ % m_sampleInterval) == 0;
+    }
+
+    bool isSlow(const SqlCallTrace &trace) const {
+        return trace.totalNsecs() > qint64(m_threshold) * 1000000;
+    }
+
+    void explain(const QSqlDatabase &db, SqlCallTrace &trace) const {
+        PGconn *connection = _pgConnection(db);
+        if (!connection || PQtransactionStatus(connection) != PQTRANS_IDLE)
+            return;
+
+        QSqlDatabase explainDb = db;
+        if (!explainDb.transaction())
+            return;
+        // EXPLAIN can not be prepared, so the arguments are inlined as literals
+        QSqlQuery explainQuery(db);
+        if (explainQuery.exec("EXPLAIN (ANALYZE, BUFFERS) " + _inlineQueryArguments(trace.query, trace.arguments))) {
+            while (explainQuery.next())
+                trace.plan << explainQuery.value(0).toString();
+        } else {
+            trace.plan << explainQuery.lastError().text();
+        }
+        explainQuery.finish();
+        explainDb.rollback();
+    }
+
+    void record(const SqlCallTrace &trace) {
+        QJsonObject phases;
+        phases["prepare_us"] = trace.prepareNsecs / 1000;
+        phases["bind_us"] = trace.bindNsecs / 1000;
+        phases["exec_us"] = trace.execNsecs / 1000;
+        phases["map_us"] = trace.mapNsecs / 1000;
+
+        QJsonObject entry;
+        entry["time"] = trace.startTime.toString(Qt::ISODate);
+        entry["connection"] = trace.connectionName;
+        entry["function"] = trace.functionName;
+        entry["query"] = trace.query;
+        entry["arguments"] = QJsonArray::fromStringList(trace.arguments);
+        entry["total_us"] = trace.totalNsecs() / 1000;
+        entry["phases"] = phases;
+        entry["rows"] = trace.rows;
+        entry["bytes"] = trace.bytes;
+        if (!trace.error.isEmpty())
+            entry["error"] = trace.error;
+        if (!trace.plan.isEmpty())
+            entry["plan"] = QJsonArray::fromStringList(trace.plan);
+
+        QByteArray line = QJsonDocument(entry).toJson(QJsonDocument::Compact) + '\n';
+
+        QMutexLocker locker(&m_fileLock);
+        QFile file(m_fileName);
+        if (m_maxFileSize > 0 && file.size() + line.size() > m_maxFileSize)
+            _rotate();
+        if (file.open(QIODevice::Append))
+            file.write(line);
+    }
+
+private:
+    void _rotate() {
+        QFile::remove(QString("%1.%2").arg(m_fileName).arg(m_maxFiles));
+        for (int i = m_maxFiles - 1 ; i > 0 ; i--)
+            QFile::rename(QString("%1.%2").arg(m_fileName).arg(i), QString("%1.%2").arg(m_fileName).arg(i + 1));
+        if (m_maxFiles > 0)
+            QFile::rename(m_fileName, QString("%1.1").arg(m_fileName));
+        else
+            QFile::remove(m_fileName);
+    }
+
+    QString m_fileName;
+    int m_sampleInterval;
+    int m_threshold;
+    bool m_explainSlowCalls;
+    qint64 m_maxFileSize;
+    int m_maxFiles;
+    std::atomic<unsigned int> m_callCount;
+    QMutex m_fileLock;
+};
+
+/*
+ * Measures one call of a mapper, phase after phase.
+ * The trace is handed to the tracer when the call is over, if it was slow.
+ */
+class SqlTracedCall
+{
+public:
+    SqlTracedCall(SqlCallTracer *tracer, const QSqlDatabase &db, const QString &functionName, const QString &query)
+        : m_tracer(tracer),
+          m_database(db),
+          m_phase(&m_trace.prepareNsecs)
+    {
+        m_trace.startTime = QDateTime::currentDateTime();
+        m_trace.connectionName = db.connectionName();
+        m_trace.functionName = functionName;
+        m_trace.query = query;
+        m_timer.start();
+    }
+
+    ~SqlTracedCall() {
+        if (m_phase)
+            *m_phase = m_timer.nsecsElapsed();
+        if (!m_tracer->isSlow(m_trace))
+            return;
+        // Tracing must never make a call fail
+        try {
+            if (m_tracer->explainSlowCalls() && m_trace.error.isEmpty())
+                m_tracer->explain(m_database, m_trace);
+            m_tracer->record(m_trace);
+        } catch (...) {
+        }
+    }
+
+    SqlTracedCall(const SqlTracedCall &) = delete;
+    SqlTracedCall &operator=(const SqlTracedCall &) = delete;
+
+    void prepared() {
+        _nextPhase(&m_trace.bindNsecs);
+    }
+
+    void bound(const QSqlQuery &query) {
+        QSqlDriver *driver = m_database.driver();
+        for (int i = 0 ; i < query.boundValues().size() ; i++) {
+            QVariant value = query.boundValue(i);
+            QSqlField field(QString(), value.type());
+            field.setValue(value);
+            m_trace.arguments << driver->formatValue(field);
+        }
+        _nextPhase(&m_trace.execNsecs);
+    }
+
+    void executed(const QSqlQuery &query) {
+        *m_phase = m_timer.nsecsElapsed();
+        m_trace.rows = query.size();
+        QVariant handle = query.result()->handle();
+        if (handle.isValid() && qstrcmp(handle.typeName(), "PGresult*") == 0) {
+            const PGresult *result = *static_cast<PGresult **>(handle.data());
+            if (result) {
+                m_trace.bytes = 0;
+                for (int row = 0 ; row < PQntuples(result) ; row++)
+                    for (int column = 0 ; column < PQnfields(result) ; column++)
+                        m_trace.bytes += PQgetlength(result, row, column);
+            }
+        }
+        _nextPhase(&m_trace.mapNsecs);
+    }
+
+    // The call failed during the current phase, whichever it is
+    void failed(const SqlError &error) {
+        *m_phase = m_timer.nsecsElapsed();
+        m_phase = nullptr;
+        m_trace.error = QString::fromStdString(error.what());
+    }
+
+private:
+    void _nextPhase(qint64 *phase) {
+        *m_phase = m_timer.nsecsElapsed();
+        m_phase = phase;
+        m_timer.restart();
+    }
+
+    SqlCallTracer *m_tracer;
+    QSqlDatabase m_database;
+    SqlCallTrace m_trace;
+    QElapsedTimer m_timer;
+    qint64 *m_phase;
+};
+
+#endif // SQLTRACER_H
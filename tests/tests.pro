@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# Checks of the parts that do not need a server
+#
+#-------------------------------------------------
+
+QT       += core sql testlib
+
+QT       -= gui
+
+TARGET = tst_storedproq
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+SOURCES += tst_storedproq.cpp
+
+INCLUDEPATH += ../src
+INCLUDEPATH += $$system(pg_config --includedir)
+LIBS += -lpq
+
+CONFIG += c++17
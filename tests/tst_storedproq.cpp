@@ -0,0 +1,359 @@
+/*
+ * This file is part of the StoredProq project
+ * distributed under the MIT License (MIT)
+ *
+ * Copyright (c) 2015 Pierre Ducroquet <pinaraf@pinaraf.info>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <QtTest>
+#include <QObject>
+#include <QSqlDatabase>
+#include <QTemporaryDir>
+
+#include <clocale>
+#include <cmath>
+#include <cstring>
+
+#include "pqmapper_qt.h"
+#include "sqlmapper.h"
+
+struct Account
+{
+    int id;
+    std::string name;
+    std::optional<double> balance;
+};
+
+template <>
+struct pq_struct<Account>
+{
+    static constexpr bool known = true;
+    static auto fields() {
+        return std::make_tuple(pq_field("id", &Account::id), pq_field("name", &Account::name), pq_field("balance", &Account::balance));
+    }
+};
+
+class Customer : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(int id MEMBER m_id)
+    Q_PROPERTY(bool active MEMBER m_active)
+    Q_PROPERTY(double balance MEMBER m_balance)
+    Q_PROPERTY(QString name MEMBER m_name)
+
+public:
+    explicit Customer(QObject *parent = 0) : QObject(parent), m_id(0), m_active(true), m_balance(0) {}
+
+    int m_id;
+    bool m_active;
+    double m_balance;
+    QString m_name;
+};
+
+// A result built client side, each row being given as its text fields (nullptr for NULL)
+static PGresult *makeResult(const std::vector<const char *> &columns, const std::vector<std::vector<const char *>> &rows)
+{
+    PGresult *result = PQmakeEmptyPGresult(nullptr, PGRES_TUPLES_OK);
+    std::vector<PGresAttDesc> attributes(columns.size());
+    for (std::size_t column = 0 ; column < columns.size() ; column++) {
+        attributes[column].name = const_cast<char *>(columns[column]);
+        attributes[column].typid = 25;
+        attributes[column].typlen = -1;
+        attributes[column].atttypmod = -1;
+    }
+    PQsetResultAttrs(result, int(columns.size()), attributes.data());
+    for (std::size_t row = 0 ; row < rows.size() ; row++) {
+        for (std::size_t column = 0 ; column < rows[row].size() ; column++) {
+            const char *value = rows[row][column];
+            PQsetvalue(result, int(row), int(column), const_cast<char *>(value), value ? int(std::strlen(value)) : -1);
+        }
+    }
+    return result;
+}
+
+template <typename T>
+static T decode(const char *value)
+{
+    return pq_type<T>::decode(value, int(std::strlen(value)));
+}
+
+template <typename T>
+static QString encode(const T &value)
+{
+    std::optional<std::string> text = pq_type<T>::encode(value);
+    return text ? QString::fromStdString(*text) : QString();
+}
+
+// Name of the SqlError class thrown by _throwSqlError
+static QString errorClass(const char *sqlState, bool cancelled, bool deadlineExpired, bool hasDeadline, bool connectionLost)
+{
+    try {
+        _throwSqlError("failed", sqlState, cancelled, deadlineExpired, hasDeadline, connectionLost);
+    } catch (const SqlCancelledError &) {
+        return "cancelled";
+    } catch (const SqlTimeoutError &) {
+        return "timeout";
+    } catch (const SqlConnectionError &) {
+        return "connection";
+    } catch (const SqlError &) {
+        return "error";
+    }
+    return QString();
+}
+
+class TestStoredProq : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void integers() {
+        QCOMPARE(decode<int>("-42"), -42);
+        QCOMPARE(decode<long long>("9223372036854775807"), 9223372036854775807LL);
+        QCOMPARE(encode(-42), QString("-42"));
+        QVERIFY_EXCEPTION_THROWN(decode<int>("4294967296"), SqlError);
+        QVERIFY_EXCEPTION_THROWN(decode<int>("12abc"), SqlError);
+        QVERIFY_EXCEPTION_THROWN(decode<int>(""), SqlError);
+    }
+
+    void doubles() {
+        // QCoreApplication took LC_NUMERIC from the environment, force a comma decimal separator when available
+        const std::string previous = std::setlocale(LC_NUMERIC, nullptr);
+        std::setlocale(LC_NUMERIC, "de_DE.UTF-8");
+        QCOMPARE(encode(1.5), QString("1.5"));
+        QCOMPARE(encode(0.1), QString("0.1"));
+        QCOMPARE(decode<double>("1.5"), 1.5);
+        QCOMPARE(decode<double>("0.1"), 0.1);
+        QCOMPARE(decode<double>("-1e+300"), -1e300);
+        QVERIFY_EXCEPTION_THROWN(decode<double>("1,5"), SqlError);
+        std::setlocale(LC_NUMERIC, previous.c_str());
+
+        QCOMPARE(encode(std::numeric_limits<double>::infinity()), QString("Infinity"));
+        QCOMPARE(encode(-std::numeric_limits<double>::infinity()), QString("-Infinity"));
+        QCOMPARE(encode(std::nan("")), QString("NaN"));
+        QVERIFY(std::isinf(decode<double>("-Infinity")) && decode<double>("-Infinity") < 0);
+        QVERIFY(std::isnan(decode<double>("NaN")));
+    }
+
+    void booleans() {
+        QCOMPARE(decode<bool>("t"), true);
+        QCOMPARE(decode<bool>("f"), false);
+        QCOMPARE(encode(false), QString("f"));
+        QVERIFY_EXCEPTION_THROWN(decode<bool>("true"), SqlError);
+    }
+
+    void nulls() {
+        QVERIFY(!pq_type<std::optional<int>>::encode(std::nullopt));
+        QVERIFY(!pq_type<QString>::encode(QString()));
+        QCOMPARE(encode(QString("")), QString(""));
+
+        PqResult result(makeResult({"value"}, {{nullptr}}));
+        QVERIFY(!_pqDecode<std::optional<int>>(result.get(), 0, 0));
+        QCOMPARE(_pqDecode<int>(result.get(), 0, 0), 0);
+        QVERIFY(_pqDecode<QString>(result.get(), 0, 0).isNull());
+    }
+
+    void arrays() {
+        QCOMPARE(encode(std::vector<std::string>({"a\"b", "c\\d", "NULL"})), QString("{\"a\\\"b\",\"c\\\\d\",\"NULL\"}"));
+        QCOMPARE(encode(std::vector<std::optional<int>>({1, std::nullopt})), QString("{\"1\",NULL}"));
+        QCOMPARE(encode(std::vector<int>()), QString("{}"));
+        QCOMPARE(QString(pq_type<std::vector<int>>::name()), QString("integer[]"));
+
+        std::vector<std::optional<std::string>> strings = decode<std::vector<std::optional<std::string>>>("{\"a\\\"b\",NULL,\"NULL\",c}");
+        QCOMPARE(int(strings.size()), 4);
+        QCOMPARE(QString::fromStdString(*strings[0]), QString("a\"b"));
+        QVERIFY(!strings[1]);
+        QCOMPARE(QString::fromStdString(*strings[2]), QString("NULL"));
+        QCOMPARE(QString::fromStdString(*strings[3]), QString("c"));
+        QVERIFY(decode<std::vector<int>>("{}").empty());
+        QVERIFY_EXCEPTION_THROWN(decode<std::vector<int>>("{1,x}"), SqlError);
+    }
+
+    void timestamps() {
+        typedef std::chrono::system_clock::time_point time_point;
+        QCOMPARE(encode(decode<time_point>("2024-02-29 14:34:56.5+02")), QString("2024-02-29 12:34:56.500000+00"));
+        QCOMPARE(encode(decode<time_point>("2024-02-29 07:04:56-05:30")), QString("2024-02-29 12:34:56.000000+00"));
+        QCOMPARE(encode(decode<time_point>("1969-12-31 23:59:59.999999+00")), QString("1969-12-31 23:59:59.999999+00"));
+        QVERIFY(decode<time_point>("infinity") == time_point::max());
+        QVERIFY(decode<time_point>("-infinity") == time_point::min());
+        QCOMPARE(encode(time_point::max()), QString("infinity"));
+        QCOMPARE(encode(time_point::min()), QString("-infinity"));
+        // Past the range of a nanosecond clock
+        QVERIFY_EXCEPTION_THROWN(decode<time_point>("2500-01-01 00:00:00+00"), SqlError);
+        QVERIFY_EXCEPTION_THROWN(decode<time_point>("2024-02-29 12:34:56"), SqlError);
+
+        QCOMPARE(decode<QDateTime>("2500-01-01 00:00:00+00").toUTC(), QDateTime(QDate(2500, 1, 1), QTime(0, 0), Qt::UTC));
+        QCOMPARE(decode<QDateTime>("0044-03-15 12:00:00+00 BC").toUTC().date(), QDate(-44, 3, 15));
+        QCOMPARE(encode(QDateTime(QDate(-44, 3, 15), QTime(12, 0), Qt::UTC)), QString("0044-03-15 12:00:00.000000+00 BC"));
+        QCOMPARE(decode<QDateTime>("1969-12-31 23:59:59.9995+00").toMSecsSinceEpoch(), qint64(-1));
+        QVERIFY_EXCEPTION_THROWN(decode<QDateTime>("infinity"), SqlError);
+        QVERIFY(!pq_type<QDateTime>::encode(QDateTime()));
+    }
+
+    void results() {
+        PqResult result(makeResult({"id", "name", "balance"}, {{"1", "first", "1.5"}, {"2", "second", nullptr}}));
+
+        QCOMPARE(PqResultMapper<int>().map(result.get()), 1);
+        PqRows<int> ids = PqResultMapper<PqRows<int>>().map(result.get());
+        QCOMPARE(int(ids.size()), 2);
+        QCOMPARE(ids[1], 2);
+
+        std::tuple<int, std::string> first = PqResultMapper<std::tuple<int, std::string>>().map(result.get());
+        QCOMPARE(std::get<0>(first), 1);
+        QCOMPARE(QString::fromStdString(std::get<1>(first)), QString("first"));
+
+        PqRows<Account> accounts = PqResultMapper<PqRows<Account>>().map(result.get());
+        QCOMPARE(int(accounts.size()), 2);
+        QCOMPARE(QString::fromStdString(accounts[1].name), QString("second"));
+        QCOMPARE(*accounts[0].balance, 1.5);
+        QVERIFY(!accounts[1].balance);
+
+        PqResult empty(makeResult({"id"}, {}));
+        QVERIFY(!PqResultMapper<std::optional<int>>().map(empty.get()));
+
+        // A std::vector result is an array value, not the rows
+        PqResult arrays(makeResult({"values"}, {{"{1,2,3}"}, {"{4}"}}));
+        std::vector<int> values = PqResultMapper<std::vector<int>>().map(arrays.get());
+        QCOMPARE(int(values.size()), 3);
+        QCOMPARE(values[2], 3);
+        QList<std::vector<int>> rows = PqResultMapper<QList<std::vector<int>>>().map(arrays.get());
+        QCOMPARE(rows.size(), 2);
+        QCOMPARE(rows[1][0], 4);
+    }
+
+    void columns() {
+        typedef pq_row<std::tuple<int, std::string>> tuple_row;
+        const std::vector<std::string> outputColumns = {"id", "name", "balance", "active", "created"};
+        QCOMPARE(int(tuple_row::columns(outputColumns).size()), 2);
+        QVERIFY(tuple_row::columns(std::vector<std::string>({"id", "name"})).empty());
+        QCOMPARE(int(pq_row<Account>::columns({}).size()), 3);
+        QVERIFY(pq_row<int>::columns(outputColumns).empty());
+
+        std::vector<std::string> properties = pq_row<Customer *>::columns(outputColumns);
+        QCOMPARE(int(properties.size()), 4);
+        QCOMPARE(QString::fromStdString(properties[0]), QString("id"));
+        QCOMPARE(QString::fromStdString(properties[1]), QString("active"));
+
+        const std::string query = _pqBuildQuery<int, std::tuple<int, std::string>>("\"f\"", {"a", "b\"c"});
+        QCOMPARE(QString::fromStdString(query),
+                 QString("SELECT \"a\", \"b\"\"c\" FROM \"f\"($1::integer, ROW($2::integer, $3::text));"));
+        QCOMPARE(_buildSelectList(QStringList() << "a" << "b\"c"), QString("\"a\", \"b\"\"c\""));
+        QCOMPARE(_buildSelectList(QStringList()), QString("*"));
+    }
+
+    void qobjectRows() {
+        PqResult result(makeResult({"id", "active", "balance", "name", "unknown"}, {{"7", "f", "2.25", "Ada", "x"}, {nullptr, nullptr, nullptr, nullptr, nullptr}}));
+        QList<Customer *> customers = PqResultMapper<QList<Customer *>>().map(result.get());
+        QCOMPARE(customers.size(), 2);
+        QCOMPARE(customers[0]->m_id, 7);
+        QCOMPARE(customers[0]->m_active, false);
+        QCOMPARE(customers[0]->m_balance, 2.25);
+        QCOMPARE(customers[0]->m_name, QString("Ada"));
+        // NULL gives the default value of the property type
+        QCOMPARE(customers[1]->m_active, false);
+        QCOMPARE(customers[1]->m_id, 0);
+        qDeleteAll(customers);
+    }
+
+    void errors() {
+        QCOMPARE(errorClass("42P01", false, false, false, false), QString("error"));
+        QCOMPARE(errorClass("57014", false, false, true, false), QString("timeout"));
+        QCOMPARE(errorClass("57014", false, false, false, false), QString("cancelled"));
+        QCOMPARE(errorClass("57014", true, false, true, false), QString("cancelled"));
+        QCOMPARE(errorClass("", false, true, true, true), QString("timeout"));
+        QCOMPARE(errorClass("08006", false, false, false, false), QString("connection"));
+        QCOMPARE(errorClass("57P01", false, false, false, false), QString("connection"));
+        QCOMPARE(errorClass("", false, false, false, true), QString("connection"));
+
+        try {
+            _throwSqlError("failed", "23505", false, false, false, false);
+        } catch (const SqlError &error) {
+            QCOMPARE(QString::fromStdString(error.sqlState()), QString("23505"));
+            QCOMPARE(QString(error.what()), QString("failed"));
+        }
+    }
+
+    void inlineArguments() {
+        QCOMPARE(_inlineQueryArguments("SELECT * FROM \"what?\"(?::integer, ?::text);", QStringList() << "1" << "'a'"),
+                 QString("SELECT * FROM \"what?\"(1::integer, 'a'::text);"));
+        QCOMPARE(_inlineQueryArguments("SELECT * FROM f(?, ?);", QStringList() << "1"), QString("SELECT * FROM f(1, ?);"));
+    }
+
+    void tracedCallPhases() {
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QString fileName = dir.filePath("trace");
+        SqlCallTracer tracer(fileName);
+        tracer.setThreshold(0);
+
+        {
+            SqlTracedCall call(&tracer, QSqlDatabase(), "\"f\"", "SELECT * FROM \"f\"();");
+            QTest::qSleep(20);
+            call.prepared();
+            call.bound(QSqlQuery());
+            QTest::qSleep(20);
+            call.failed(SqlTimeoutError("too slow", "57014"));
+            QTest::qSleep(100);
+        }
+
+        QFile file(fileName);
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        QList<QByteArray> lines = file.readAll().split('\n');
+        QCOMPARE(lines.size(), 2);
+        QJsonObject entry = QJsonDocument::fromJson(lines[0]).object();
+        QJsonObject phases = entry["phases"].toObject();
+        QCOMPARE(entry["function"].toString(), QString("\"f\""));
+        QCOMPARE(entry["error"].toString(), QString("too slow"));
+        QVERIFY(phases["prepare_us"].toDouble() >= 20000);
+        QVERIFY(phases["exec_us"].toDouble() >= 20000);
+        // Time spent after the failure is not accounted to any phase
+        QVERIFY(entry["total_us"].toDouble() < 100000);
+        QCOMPARE(phases["map_us"].toDouble(), 0.0);
+    }
+
+    void tracerRotation() {
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QString fileName = dir.filePath("trace");
+        SqlCallTracer tracer(fileName);
+        tracer.setMaxFileSize(1);
+        tracer.setMaxFiles(2);
+
+        for (int i = 0 ; i < 4 ; i++) {
+            SqlCallTrace trace;
+            trace.functionName = QString::number(i);
+            tracer.record(trace);
+        }
+        QVERIFY(QFile::exists(fileName));
+        QVERIFY(QFile::exists(fileName + ".1"));
+        QVERIFY(QFile::exists(fileName + ".2"));
+        QVERIFY(!QFile::exists(fileName + ".3"));
+
+        tracer.setSampleInterval(3);
+        QVERIFY(tracer.sample());
+        QVERIFY(!tracer.sample());
+        QVERIFY(!tracer.sample());
+        QVERIFY(tracer.sample());
+    }
+};
+
+QTEST_GUILESS_MAIN(TestStoredProq)
+
+#include "tst_storedproq.moc"